@@ -0,0 +1,116 @@
+import argparse
+import json
+import os
+import platform
+import time
+
+import pygemma
+
+
+def parse_list(text):
+    return [int(value) for value in text.split(",") if value]
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Measures prefill and decode speed of pygemma and writes JSON."
+    )
+    parser.add_argument(
+        "--tokenizer", type=str, required=True, help="Path to the tokenizer file."
+    )
+    parser.add_argument(
+        "--compressed_weights",
+        type=str,
+        required=True,
+        help="Path to the compressed weights file.",
+    )
+    parser.add_argument(
+        "--model", type=str, required=True, help="Model type identifier."
+    )
+    parser.add_argument(
+        "--prompt_lengths",
+        type=parse_list,
+        default=[32, 128, 512],
+        help="Comma-separated prompt lengths in tokens.",
+    )
+    parser.add_argument(
+        "--threads",
+        type=parse_list,
+        default=[],
+        help="Comma-separated thread counts; default: one thread per physical core.",
+    )
+    parser.add_argument(
+        "--runs",
+        type=int,
+        default=1,
+        help="Generations run one after the other per measurement.",
+    )
+    parser.add_argument(
+        "--max_new_tokens", type=int, default=128, help="Tokens decoded per request."
+    )
+    parser.add_argument(
+        "--repetitions", type=int, default=3, help="Measurements per configuration."
+    )
+    parser.add_argument(
+        "--output", type=str, default=None, help="JSON file; default: stdout."
+    )
+    args = parser.parse_args()
+
+    results = []
+    for num_threads in args.threads or [None]:
+        load_start = time.perf_counter()
+        model = pygemma.Gemma(
+            [
+                "--tokenizer",
+                args.tokenizer,
+                "--compressed_weights",
+                args.compressed_weights,
+                "--model",
+                args.model,
+            ],
+            num_threads=num_threads,
+        )
+        load_s = time.perf_counter() - load_start
+        # Warm up caches and page in the weights before measuring.
+        model.benchmark(prompt_length=min(args.prompt_lengths), max_new_tokens=8)
+        for prompt_length in args.prompt_lengths:
+            for repetition in range(args.repetitions):
+                result = model.benchmark(
+                    prompt_length=prompt_length,
+                    max_new_tokens=args.max_new_tokens,
+                    runs=args.runs,
+                )
+                result["repetition"] = repetition
+                result["load_s"] = load_s
+                results.append(result)
+                print(
+                    "threads={num_threads} prompt={prompt_length}: "
+                    "prefill {prefill_tokens_per_s:.1f} tok/s, "
+                    "decode {decode_tokens_per_s:.1f} tok/s, "
+                    "TTFT {ttft_ms:.1f} ms, p99 {inter_token_p99_ms:.1f} ms".format(
+                        **result
+                    ),
+                    flush=True,
+                )
+        del model
+
+    report = {
+        "model": args.model,
+        "compressed_weights": os.path.basename(args.compressed_weights),
+        "top_k": pygemma.top_k,
+        "machine": platform.machine(),
+        "processor": platform.processor(),
+        "system": platform.platform(),
+        "cpu_count": os.cpu_count(),
+        "time": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "results": results,
+    }
+    if args.output:
+        with open(args.output, "w") as file:
+            json.dump(report, file, indent=2)
+    else:
+        print(json.dumps(report, indent=2))
+
+
+if __name__ == "__main__":
+    main()
@@ -29,7 +29,10 @@ class CMakeBuild(build_ext):
         cmake_args = [
             "-DCMAKE_LIBRARY_OUTPUT_DIRECTORY=" + extdir,
             "-DPYTHON_EXECUTABLE=" + sys.executable,
+            "-DPYGEMMA_BUILD_TESTS=OFF",
         ]
+        # Extra options such as -DGEMMA_TOPK=40
+        cmake_args += os.environ.get("CMAKE_ARGS", "").split()
 
         cfg = "Debug" if self.debug else "Release"
         build_args = ["--config", cfg]
@@ -66,6 +69,7 @@ setup(
     ext_modules=[CMakeExtension("pygemma")],
     cmdclass=dict(build_ext=CMakeBuild),
     zip_safe=False,
+    install_requires=["numpy"],
     packages=find_packages(),
     classifiers=[
         "Programming Language :: Python :: 3",
@@ -0,0 +1,138 @@
+#ifndef GEMMA_CPP_PYTHON_ASYNC_CONSUMER_H_
+#define GEMMA_CPP_PYTHON_ASYNC_CONSUMER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread> // NOLINT
+#include <utility>
+
+#include "spsc_ring.h"
+
+namespace gcpp
+{
+
+    // Moves slow work, such as printing or calling into Python, off the
+    // decode loop. Push() queues a value in an SpscRing and a consumer thread
+    // passes the values to `consume` in order. Push() takes no lock while the
+    // consumer is busy; it takes one only to wake an idle consumer, and it
+    // waits only if the ring is full. One producer thread at a time.
+    template <class T>
+    class AsyncConsumer
+    {
+    public:
+        // Once `consume` returns false or throws, later values are dropped.
+        AsyncConsumer(size_t capacity, std::function<bool(T &)> consume)
+            : ring_(capacity), consume_(std::move(consume)), thread_([this]
+                                                                    { Loop(); }) {}
+
+        ~AsyncConsumer()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                closing_ = true;
+            }
+            wake_cv_.notify_one();
+            thread_.join();
+        }
+
+        AsyncConsumer(const AsyncConsumer &) = delete;
+        AsyncConsumer &operator=(const AsyncConsumer &) = delete;
+
+        // Queues `value`. Returns false if `consume` already returned false,
+        // so the producer learns about it at most a few values late.
+        bool Push(T value)
+        {
+            while (!ring_.TryPush(std::move(value)))
+            {
+                std::this_thread::yield(); // the consumer is a whole ring behind
+            }
+            pushed_.fetch_add(1);
+            if (parked_.load())
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                wake_cv_.notify_one();
+            }
+            return !stopped_.load(std::memory_order_relaxed);
+        }
+
+        // Waits until every queued value was consumed, then rethrows the
+        // exception `consume` threw, if any.
+        void Drain()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            drained_cv_.wait(lock, [this]
+                             { return consumed_.load() == pushed_.load(); });
+            if (error_)
+            {
+                std::rethrow_exception(std::exchange(error_, nullptr));
+            }
+        }
+
+    private:
+        void Loop()
+        {
+            T value;
+            for (;;)
+            {
+                while (ring_.TryPop(value))
+                {
+                    Consume(value);
+                    consumed_.fetch_add(1);
+                }
+                std::unique_lock<std::mutex> lock(mutex_);
+                drained_cv_.notify_all();
+                // With pushed_ and parked_ both sequentially consistent, either
+                // Push() sees parked_ set or the wait below sees its value.
+                parked_.store(true);
+                wake_cv_.wait(lock, [this]
+                              { return closing_ || consumed_.load() != pushed_.load(); });
+                parked_.store(false);
+                if (closing_ && consumed_.load() == pushed_.load())
+                {
+                    return;
+                }
+            }
+        }
+
+        void Consume(T &value)
+        {
+            if (stopped_.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+            try
+            {
+                if (!consume_(value))
+                {
+                    stopped_.store(true, std::memory_order_relaxed);
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                error_ = std::current_exception();
+                stopped_.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        SpscRing<T> ring_;
+        std::function<bool(T &)> consume_;
+        std::atomic<size_t> pushed_{0};
+        std::atomic<size_t> consumed_{0};
+        std::atomic<bool> parked_{false};  // the consumer waits for wake_cv_
+        std::atomic<bool> stopped_{false}; // consume_ returned false or threw
+        std::mutex mutex_;                 // guards the members below
+        std::condition_variable wake_cv_;
+        std::condition_variable drained_cv_;
+        bool closing_ = false;
+        std::exception_ptr error_;
+        std::thread thread_; // last, starts once the members above exist
+    };
+
+} // namespace gcpp
+
+#endif // GEMMA_CPP_PYTHON_ASYNC_CONSUMER_H_
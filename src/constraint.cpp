@@ -0,0 +1,559 @@
+#include "constraint.h"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+#include <utility>
+
+namespace gcpp
+{
+
+    namespace
+    {
+
+        using ByteSet = std::array<uint64_t, 4>;
+
+        void AddByte(ByteSet &set, unsigned char byte) { set[byte / 64] |= uint64_t{1} << (byte % 64); }
+
+        void AddRange(ByteSet &set, unsigned char first, unsigned char last)
+        {
+            for (int byte = first; byte <= last; ++byte)
+            {
+                AddByte(set, static_cast<unsigned char>(byte));
+            }
+        }
+
+        bool HasByte(const ByteSet &set, unsigned char byte)
+        {
+            return (set[byte / 64] >> (byte % 64)) & 1;
+        }
+
+        ByteSet Complement(const ByteSet &set)
+        {
+            return {~set[0], ~set[1], ~set[2], ~set[3]};
+        }
+
+        // Limits the NFA built from counted repetition such as (...){1000}.
+        constexpr size_t kMaxNfaStates = size_t{1} << 16;
+
+        // Regex syntax tree.
+        struct Node
+        {
+            enum class Kind
+            {
+                kBytes,  // one byte out of `bytes`
+                kConcat, // `children` in order
+                kAlt,    // one of `children`
+                kRepeat, // children[0], min to max times (max < 0: unbounded)
+            };
+            explicit Node(Kind node_kind) : kind(node_kind) {}
+
+            Kind kind;
+            ByteSet bytes{};
+            std::vector<Node> children;
+            int min = 0;
+            int max = 0;
+        };
+
+    } // namespace
+
+    // Recursive descent over the pattern, then Thompson construction.
+    class RegexConstraint::Parser
+    {
+    public:
+        Parser(const std::string &pattern, std::vector<NfaState> *nfa)
+            : pattern_(pattern), nfa_(nfa) {}
+
+        // Returns the accepting NFA state; the start state is 0.
+        int Compile()
+        {
+            NewState(); // the start state
+            const Node root = ParseAlt();
+            if (pos_ != pattern_.size())
+            {
+                Fail("unmatched ')'");
+            }
+            const Fragment fragment = Build(root);
+            (*nfa_)[0].epsilon.push_back(fragment.start);
+            return fragment.end;
+        }
+
+    private:
+        struct Fragment
+        {
+            int start;
+            int end; // has no outgoing edges yet
+        };
+
+        [[noreturn]] void Fail(const std::string &message) const
+        {
+            throw std::invalid_argument("invalid regex at offset " + std::to_string(pos_) +
+                                        ": " + message);
+        }
+
+        bool AtEnd() const { return pos_ >= pattern_.size(); }
+        char Peek() const { return pattern_[pos_]; }
+
+        Node ParseAlt()
+        {
+            Node alt(Node::Kind::kAlt);
+            alt.children.push_back(ParseConcat());
+            while (!AtEnd() && Peek() == '|')
+            {
+                ++pos_;
+                alt.children.push_back(ParseConcat());
+            }
+            return alt.children.size() == 1 ? std::move(alt.children[0]) : std::move(alt);
+        }
+
+        Node ParseConcat()
+        {
+            Node concat(Node::Kind::kConcat);
+            while (!AtEnd() && Peek() != '|' && Peek() != ')')
+            {
+                concat.children.push_back(ParseRepeat());
+            }
+            return concat;
+        }
+
+        Node ParseRepeat()
+        {
+            Node node = ParseAtom();
+            while (!AtEnd())
+            {
+                int min;
+                int max;
+                const char c = Peek();
+                if (c == '*' || c == '+' || c == '?')
+                {
+                    ++pos_;
+                    min = c == '+' ? 1 : 0;
+                    max = c == '?' ? 1 : -1;
+                }
+                else if (c == '{')
+                {
+                    ++pos_;
+                    min = max = ParseCount();
+                    if (!AtEnd() && Peek() == ',')
+                    {
+                        ++pos_;
+                        max = !AtEnd() && Peek() == '}' ? -1 : ParseCount();
+                    }
+                    if (AtEnd() || Peek() != '}')
+                    {
+                        Fail("expected '}'");
+                    }
+                    ++pos_;
+                    if (max >= 0 && max < min)
+                    {
+                        Fail("repetition maximum below minimum");
+                    }
+                }
+                else
+                {
+                    break;
+                }
+                Node repeat(Node::Kind::kRepeat);
+                repeat.min = min;
+                repeat.max = max;
+                repeat.children.push_back(std::move(node));
+                node = std::move(repeat);
+            }
+            return node;
+        }
+
+        int ParseCount()
+        {
+            const size_t begin = pos_;
+            int count = 0;
+            while (!AtEnd() && isdigit(static_cast<unsigned char>(Peek())))
+            {
+                count = count * 10 + (Peek() - '0');
+                if (count > 1000)
+                {
+                    Fail("repetition count above 1000");
+                }
+                ++pos_;
+            }
+            if (pos_ == begin)
+            {
+                Fail("expected a repetition count");
+            }
+            return count;
+        }
+
+        Node ParseAtom()
+        {
+            Node node(Node::Kind::kBytes);
+            const char c = Peek();
+            switch (c)
+            {
+            case '(':
+            {
+                ++pos_;
+                if (pattern_.compare(pos_, 2, "?:") == 0)
+                {
+                    pos_ += 2;
+                }
+                else if (!AtEnd() && Peek() == '?')
+                {
+                    Fail("unsupported group type");
+                }
+                Node group = ParseAlt();
+                if (AtEnd() || Peek() != ')')
+                {
+                    Fail("expected ')'");
+                }
+                ++pos_;
+                return group;
+            }
+            case '[':
+                ++pos_;
+                node.bytes = ParseClass();
+                return node;
+            case '.':
+                ++pos_;
+                AddByte(node.bytes, '\n');
+                node.bytes = Complement(node.bytes);
+                return node;
+            case '\\':
+                ++pos_;
+                node.bytes = ParseEscape(/*in_class=*/false);
+                return node;
+            case '*':
+            case '+':
+            case '?':
+            case '{':
+                Fail("nothing to repeat");
+            case '^':
+            case '$':
+                Fail("anchors are implicit, the pattern always matches the whole output");
+            default:
+                ++pos_;
+                AddByte(node.bytes, static_cast<unsigned char>(c));
+                return node;
+            }
+        }
+
+        ByteSet ParseEscape(bool in_class)
+        {
+            if (AtEnd())
+            {
+                Fail("trailing backslash");
+            }
+            const char c = pattern_[pos_++];
+            ByteSet set{};
+            switch (c)
+            {
+            case 'd':
+            case 'D':
+                AddRange(set, '0', '9');
+                break;
+            case 'w':
+            case 'W':
+                AddRange(set, 'a', 'z');
+                AddRange(set, 'A', 'Z');
+                AddRange(set, '0', '9');
+                AddByte(set, '_');
+                break;
+            case 's':
+            case 'S':
+                for (const char space : std::string(" \t\n\r\f\v"))
+                {
+                    AddByte(set, static_cast<unsigned char>(space));
+                }
+                break;
+            case 'n':
+                AddByte(set, '\n');
+                return set;
+            case 't':
+                AddByte(set, '\t');
+                return set;
+            case 'r':
+                AddByte(set, '\r');
+                return set;
+            case 'f':
+                AddByte(set, '\f');
+                return set;
+            case 'v':
+                AddByte(set, '\v');
+                return set;
+            default:
+                if (isalnum(static_cast<unsigned char>(c)))
+                {
+                    Fail(std::string("unsupported escape \\") + c);
+                }
+                AddByte(set, static_cast<unsigned char>(c));
+                return set;
+            }
+            if (isupper(static_cast<unsigned char>(c)))
+            {
+                if (in_class)
+                {
+                    Fail(std::string("\\") + c + " inside a class is not supported");
+                }
+                set = Complement(set);
+            }
+            return set;
+        }
+
+        // After '['; consumes the closing ']'.
+        ByteSet ParseClass()
+        {
+            ByteSet set{};
+            const bool negate = !AtEnd() && Peek() == '^';
+            if (negate)
+            {
+                ++pos_;
+            }
+            bool first = true;
+            while (AtEnd() || Peek() != ']' || first)
+            {
+                if (AtEnd())
+                {
+                    Fail("expected ']'");
+                }
+                first = false;
+                if (Peek() == '\\')
+                {
+                    ++pos_;
+                    const ByteSet escaped = ParseEscape(/*in_class=*/true);
+                    for (size_t i = 0; i < set.size(); ++i)
+                    {
+                        set[i] |= escaped[i];
+                    }
+                    continue;
+                }
+                const unsigned char low = static_cast<unsigned char>(pattern_[pos_++]);
+                unsigned char high = low;
+                if (pos_ + 1 < pattern_.size() && Peek() == '-' && pattern_[pos_ + 1] != ']')
+                {
+                    high = static_cast<unsigned char>(pattern_[pos_ + 1]);
+                    pos_ += 2;
+                    if (high < low)
+                    {
+                        Fail("class range out of order");
+                    }
+                }
+                if (high >= 0x80)
+                {
+                    Fail("non-ASCII characters in classes are not supported");
+                }
+                AddRange(set, low, high);
+            }
+            ++pos_;
+            if (negate)
+            {
+                set = Complement(set);
+            }
+            if (set == ByteSet{})
+            {
+                Fail("empty class"); // would leave states that cannot reach a match
+            }
+            return set;
+        }
+
+        int NewState()
+        {
+            if (nfa_->size() >= kMaxNfaStates)
+            {
+                throw std::invalid_argument("regex is too large");
+            }
+            nfa_->emplace_back();
+            return static_cast<int>(nfa_->size() - 1);
+        }
+
+        void Epsilon(int from, int to) { (*nfa_)[from].epsilon.push_back(to); }
+
+        Fragment Build(const Node &node)
+        {
+            switch (node.kind)
+            {
+            case Node::Kind::kBytes:
+            {
+                const Fragment fragment{NewState(), NewState()};
+                (*nfa_)[fragment.start].bytes = node.bytes;
+                (*nfa_)[fragment.start].next = fragment.end;
+                return fragment;
+            }
+            case Node::Kind::kConcat:
+            {
+                const int start = NewState();
+                int end = start;
+                for (const Node &child : node.children)
+                {
+                    const Fragment fragment = Build(child);
+                    Epsilon(end, fragment.start);
+                    end = fragment.end;
+                }
+                return {start, end};
+            }
+            case Node::Kind::kAlt:
+            {
+                const Fragment fragment{NewState(), NewState()};
+                for (const Node &child : node.children)
+                {
+                    const Fragment branch = Build(child);
+                    Epsilon(fragment.start, branch.start);
+                    Epsilon(branch.end, fragment.end);
+                }
+                return fragment;
+            }
+            case Node::Kind::kRepeat:
+            {
+                const int start = NewState();
+                int end = start;
+                for (int i = 0; i < node.min; ++i)
+                {
+                    const Fragment copy = Build(node.children[0]);
+                    Epsilon(end, copy.start);
+                    end = copy.end;
+                }
+                if (node.max < 0)
+                {
+                    const Fragment loop = Build(node.children[0]);
+                    const int exit = NewState();
+                    Epsilon(end, loop.start);
+                    Epsilon(end, exit);
+                    Epsilon(loop.end, loop.start);
+                    Epsilon(loop.end, exit);
+                    return {start, exit};
+                }
+                const int exit = NewState();
+                for (int i = node.min; i < node.max; ++i)
+                {
+                    const Fragment copy = Build(node.children[0]);
+                    Epsilon(end, copy.start);
+                    Epsilon(end, exit);
+                    end = copy.end;
+                }
+                Epsilon(end, exit);
+                return {start, exit};
+            }
+            }
+            return {NewState(), NewState()};
+        }
+
+        const std::string &pattern_;
+        std::vector<NfaState> *nfa_;
+        size_t pos_ = 0;
+    };
+
+    RegexConstraint::RegexConstraint(const std::string &pattern,
+                                     std::shared_ptr<const std::vector<std::string>> token_bytes,
+                                     int eos_id)
+        : token_bytes_(std::move(token_bytes)), eos_id_(eos_id)
+    {
+        nfa_accept_ = Parser(pattern, &nfa_).Compile();
+        std::lock_guard<std::mutex> lock(mutex_);
+        AddDfaState({0}); // kStart
+    }
+
+    void RegexConstraint::CheckPattern(const std::string &pattern)
+    {
+        std::vector<NfaState> nfa;
+        Parser(pattern, &nfa).Compile();
+    }
+
+    size_t RegexConstraint::AddDfaState(std::vector<int> nfa_states) const
+    {
+        // Epsilon closure.
+        std::vector<bool> seen(nfa_.size());
+        for (size_t i = 0; i < nfa_states.size(); ++i)
+        {
+            seen[nfa_states[i]] = true;
+        }
+        for (size_t i = 0; i < nfa_states.size(); ++i)
+        {
+            for (const int next : nfa_[nfa_states[i]].epsilon)
+            {
+                if (!seen[next])
+                {
+                    seen[next] = true;
+                    nfa_states.push_back(next);
+                }
+            }
+        }
+        std::sort(nfa_states.begin(), nfa_states.end());
+
+        const auto found = dfa_index_.find(nfa_states);
+        if (found != dfa_index_.end())
+        {
+            return found->second;
+        }
+        DfaState state;
+        state.accepting = seen[nfa_accept_];
+        state.next.fill(-2);
+        state.nfa_states = nfa_states;
+        dfa_.push_back(std::move(state));
+        dfa_index_.emplace(std::move(nfa_states), dfa_.size() - 1);
+        return dfa_.size() - 1;
+    }
+
+    int32_t RegexConstraint::Step(size_t state, unsigned char byte) const
+    {
+        if (dfa_[state].next[byte] != -2)
+        {
+            return dfa_[state].next[byte];
+        }
+        std::vector<int> targets;
+        for (const int nfa_state : dfa_[state].nfa_states)
+        {
+            if (nfa_[nfa_state].next >= 0 && HasByte(nfa_[nfa_state].bytes, byte))
+            {
+                targets.push_back(nfa_[nfa_state].next);
+            }
+        }
+        const int32_t next = targets.empty() ? -1 : static_cast<int32_t>(AddDfaState(std::move(targets)));
+        dfa_[state].next[byte] = next; // after AddDfaState, which may grow dfa_
+        return next;
+    }
+
+    size_t RegexConstraint::Walk(size_t state, const std::string &bytes) const
+    {
+        for (const char byte : bytes)
+        {
+            const int32_t next = Step(state, static_cast<unsigned char>(byte));
+            if (next < 0)
+            {
+                return Dead();
+            }
+            state = static_cast<size_t>(next);
+        }
+        return state;
+    }
+
+    const std::vector<uint64_t> &RegexConstraint::Allowed(size_t state) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!dfa_[state].allowed)
+        {
+            const std::vector<std::string> &tokens = *token_bytes_;
+            auto allowed = std::make_unique<std::vector<uint64_t>>((tokens.size() + 63) / 64);
+            for (size_t token = 0; token < tokens.size(); ++token)
+            {
+                const bool ok = static_cast<int>(token) == eos_id_
+                                    ? dfa_[state].accepting
+                                    : !tokens[token].empty() && Walk(state, tokens[token]) != Dead();
+                if (ok)
+                {
+                    (*allowed)[token / 64] |= uint64_t{1} << (token % 64);
+                }
+            }
+            dfa_[state].allowed = std::move(allowed);
+        }
+        return *dfa_[state].allowed;
+    }
+
+    size_t RegexConstraint::Next(size_t state, int token) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const size_t index = static_cast<size_t>(token);
+        if (index >= token_bytes_->size() || (*token_bytes_)[index].empty())
+        {
+            return Dead();
+        }
+        return Walk(state, (*token_bytes_)[index]);
+    }
+
+} // namespace gcpp
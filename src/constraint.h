@@ -0,0 +1,129 @@
+#ifndef GEMMA_CPP_PYTHON_CONSTRAINT_H_
+#define GEMMA_CPP_PYTHON_CONSTRAINT_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace gcpp
+{
+
+    // Restricts generated text to a regular expression that must match the
+    // whole output. The pattern is compiled to an NFA and explored lazily as
+    // a byte-level DFA; for every DFA state reached, the set of vocabulary
+    // tokens that keep the text on a path to a match is computed once and
+    // kept as a bitmask. Thread-safe; matchers share one constraint.
+    //
+    // Supported syntax: literals, escapes (\d \w \s \D \W \S \n \t and
+    // escaped metacharacters), ".", classes such as [a-z_] and [^"\\], groups
+    // "(...)" and "(?:...)", "|", and the quantifiers * + ? {m} {m,} {m,n}.
+    // Classes and "." work on bytes: non-ASCII characters match through
+    // negated classes and "." but cannot be listed in a class.
+    class RegexConstraint
+    {
+    public:
+        // `token_bytes[i]` is the text of token i; empty for tokens that are
+        // never allowed (control tokens etc.). `eos_id` is allowed exactly
+        // when the text so far matches. Throws std::invalid_argument if the
+        // pattern is malformed or uses unsupported syntax.
+        RegexConstraint(const std::string &pattern,
+                        std::shared_ptr<const std::vector<std::string>> token_bytes,
+                        int eos_id);
+
+        RegexConstraint(const RegexConstraint &) = delete;
+        RegexConstraint &operator=(const RegexConstraint &) = delete;
+
+        // Throws like the constructor if `pattern` is malformed, without
+        // needing a vocabulary.
+        static void CheckPattern(const std::string &pattern);
+
+        static constexpr size_t kStart = 0;
+
+        // Bitmask over the vocabulary of the tokens allowed in `state`. The
+        // returned reference stays valid for the constraint's lifetime.
+        const std::vector<uint64_t> &Allowed(size_t state) const;
+
+        // State after `token`; Dead() if the token leaves the language.
+        size_t Next(size_t state, int token) const;
+
+        static constexpr size_t Dead() { return ~size_t{0}; }
+
+        int EosId() const { return eos_id_; }
+
+    private:
+        struct NfaState
+        {
+            std::array<uint64_t, 4> bytes{}; // bytes leading to `next`
+            int next = -1;
+            std::vector<int> epsilon;
+        };
+
+        struct DfaState
+        {
+            std::vector<int> nfa_states; // sorted epsilon closure
+            bool accepting = false;
+            std::array<int32_t, 256> next; // -2 = not computed yet, -1 = dead
+            std::unique_ptr<std::vector<uint64_t>> allowed;
+        };
+
+        class Parser;
+
+        // Requires mutex_.
+        size_t AddDfaState(std::vector<int> nfa_states) const;
+        int32_t Step(size_t state, unsigned char byte) const;
+        size_t Walk(size_t state, const std::string &bytes) const;
+
+        std::vector<NfaState> nfa_;
+        int nfa_accept_ = -1;
+        std::shared_ptr<const std::vector<std::string>> token_bytes_;
+        int eos_id_;
+
+        mutable std::mutex mutex_; // guards the lazily built DFA
+        mutable std::vector<DfaState> dfa_;
+        mutable std::map<std::vector<int>, size_t> dfa_index_;
+    };
+
+    // Follows one generation through a RegexConstraint: Accept() is the
+    // AcceptFunc for the next token and Advance() records the sampled one.
+    class ConstraintMatcher
+    {
+    public:
+        explicit ConstraintMatcher(std::shared_ptr<const RegexConstraint> constraint)
+            : constraint_(std::move(constraint)), state_(RegexConstraint::kStart),
+              allowed_(&constraint_->Allowed(state_)) {}
+
+        bool Accept(int token) const
+        {
+            const size_t index = static_cast<size_t>(token);
+            return index / 64 < allowed_->size() && ((*allowed_)[index / 64] >> (index % 64)) & 1;
+        }
+
+        // Returns false if `token` was not allowed, e.g. because no token was.
+        bool Advance(int token)
+        {
+            if (!Accept(token))
+            {
+                return false;
+            }
+            if (token != constraint_->EosId())
+            {
+                state_ = constraint_->Next(state_, token);
+                allowed_ = &constraint_->Allowed(state_);
+            }
+            return true;
+        }
+
+    private:
+        std::shared_ptr<const RegexConstraint> constraint_;
+        size_t state_;
+        const std::vector<uint64_t> *allowed_; // of state_
+    };
+
+} // namespace gcpp
+
+#endif // GEMMA_CPP_PYTHON_CONSTRAINT_H_
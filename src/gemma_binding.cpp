@@ -1,15 +1,40 @@
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 // #include "gemma.h" // Adjust include path as necessary
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <ctime>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <queue>
 #include <random>
+#include <set>
+#include <stdexcept>
 #include <string>
 #include <thread> // NOLINT
+#include <tuple>
 #include <vector>
 
+#include "async_consumer.h"
 #include "compression/compress.h"
+#include "configs.h" // ConfigGemma2B, kSeqLen
+#include "constraint.h"
 #include "gemma.h" // Gemma
+#include "mapped_file.h"
+#include "stream_channel.h"
+#include "text_stream.h"
+#include "threading.h"
 #include "util/app.h"
 #include "util/args.h" // HasHelp
 #include "hwy/base.h"
@@ -19,11 +44,42 @@
 #include "hwy/profiler.h"
 #include "hwy/timer.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
 namespace py = pybind11;
 
 namespace gcpp
 {
 
+    // Flags of the Python model that gemma.cpp's InferenceArgs does not have.
+    class ServingArgs : public ArgsBase<ServingArgs>
+    {
+    public:
+        ServingArgs(int argc, char *argv[]) { InitAndParse(argc, argv); }
+
+        // Tokens prefilled per GenerateGemma call, rounded up to a multiple of
+        // kPrefillBatchSize; 0 prefills the whole prompt in one call.
+        size_t PrefillChunk() const
+        {
+            return (prefill_chunk + kPrefillBatchSize - 1) / kPrefillBatchSize *
+                   kPrefillBatchSize;
+        }
+
+        size_t prefill_chunk;
+
+        template <class Visitor>
+        void ForEach(const Visitor &visitor)
+        {
+            visitor(prefill_chunk, "prefill_chunk", size_t{0},
+                    "Prefill long prompts in chunks of this many tokens; 0 = whole prompt.\n"
+                    "    Between chunks an Engine with time_slice > 0 lets higher priority\n"
+                    "    requests run first.",
+                    2);
+        }
+    };
+
     void ShowHelp(gcpp::LoaderArgs &loader, gcpp::InferenceArgs &inference,
                   gcpp::AppArgs &app)
     {
@@ -37,9 +93,90 @@ namespace gcpp
         inference.Help();
         fprintf(stderr, "\nApplication Arguments\n\n");
         app.Help();
+        fprintf(stderr, "\nThreading Arguments\n\n");
+        ThreadingArgs(0, nullptr).Help();
+        fprintf(stderr, "\nWeight Prefetch Arguments\n\n");
+        PrefetchArgs(0, nullptr).Help();
+        fprintf(stderr, "\nServing Arguments\n\n");
+        ServingArgs(0, nullptr).Help();
         fprintf(stderr, "\n\n");
     }
 
+    // Without an explicit --num_threads, sizes the pool to the physical cores
+    // it may use; --pin=auto then gives each thread a core of its own.
+    // gemma.cpp's own default stops at 18 threads, which leaves most of a
+    // larger machine idle during decode.
+    void DefaultNumThreads(int argc, char **argv, AppArgs &app,
+                           const ThreadingArgs &threading)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            if (std::string(argv[i]) == "--num_threads")
+            {
+                return;
+            }
+        }
+        app.num_threads = threading.DefaultNumThreads();
+    }
+
+    // Maps the weights file as --prefetch_weights asks, before gcpp::Gemma
+    // reads it. gemma.cpp copies the weights into its own buffers, so this
+    // cannot avoid that copy; instead the page cache is filled with parallel
+    // reads, and with "lock" it stays resident and shared with every other
+    // process serving the same file, so reloads skip the disk. Returns
+    // nullptr for "none" or where the file cannot be mapped.
+    std::unique_ptr<MappedFile> PrefetchWeights(const LoaderArgs &loader,
+                                                const PrefetchArgs &prefetch,
+                                                hwy::ThreadPool &pool, int verbosity)
+    {
+        if (prefetch.prefetch_weights == "none")
+        {
+            return nullptr;
+        }
+        std::unique_ptr<MappedFile> file = MappedFile::Open(loader.cache.path);
+        if (!file)
+        {
+            if (verbosity >= 1)
+            {
+                fprintf(stderr, "Cannot map %s, loading without prefetch.\n",
+                        loader.cache.path.c_str());
+            }
+            return nullptr;
+        }
+        file->Populate(pool);
+        if (prefetch.prefetch_weights == "lock" && !file->Lock() && verbosity >= 1)
+        {
+            fprintf(stderr, "Cannot lock %zu bytes of weights; raise RLIMIT_MEMLOCK.\n",
+                    file->Size());
+        }
+        if (prefetch.prefetch_weights != "lock")
+        {
+            file.reset(); // the pages stay cached until memory pressure evicts them
+        }
+        return file;
+    }
+
+    // Size of gemma.cpp's KV cache per token: keys and values of every layer,
+    // stored as float. The cache is allocated for kSeqLen tokens per model.
+    template <class TConfig>
+    constexpr size_t KVBytesPerToken()
+    {
+        return size_t{2} * TConfig::kLayers * TConfig::kKVHeads * TConfig::kQKVDim *
+               sizeof(float);
+    }
+
+    size_t KVBytesPerToken(Model model)
+    {
+        switch (model)
+        {
+        case Model::GEMMA_2B:
+            return KVBytesPerToken<ConfigGemma2B>();
+        case Model::GEMMA_7B:
+            return KVBytesPerToken<ConfigGemma7B>();
+        }
+        return 0;
+    }
+
     void ShowConfig(LoaderArgs &loader, InferenceArgs &inference, AppArgs &app)
     {
         loader.Print(app.verbosity);
@@ -63,6 +200,24 @@ namespace gcpp
                       << gcpp::TypeName(gcpp::WeightT()) << "\n"
                       << "EmbedderInput Type            : "
                       << gcpp::TypeName(gcpp::EmbedderInputT()) << "\n";
+
+            const size_t kv_bytes = KVBytesPerToken(loader.ModelType());
+            std::cout << "KV Cache                      : "
+                      << (kv_bytes * gcpp::kSeqLen >> 20) << " MiB f32 ("
+                      << (kv_bytes >> 10) << " KiB per token, " << gcpp::kSeqLen
+                      << " tokens)\n";
+
+            const std::vector<CpuInfo> &topology = DetectTopology();
+            std::set<size_t> packages, cores, nodes;
+            for (const CpuInfo &info : topology)
+            {
+                packages.insert(info.package);
+                cores.insert(info.core);
+                nodes.insert(info.node);
+            }
+            std::cout << "Topology                      : " << topology.size()
+                      << " CPUs, " << cores.size() << " cores, " << packages.size()
+                      << " sockets, " << nodes.size() << " NUMA nodes\n";
         }
     }
 
@@ -86,27 +241,24 @@ namespace gcpp
             gen.seed(rd());
         }
 
-        // callback function invoked for each generated token.
-        auto stream_token = [&abs_pos, &current_pos, &args, &gen, &prompt_size,
-                             tokenizer = &model.Tokenizer(),
-                             verbosity](int token, float)
+        // Prints the tokens on its own thread, so that detokenizing and
+        // writing to a slow terminal or pipe do not hold up the decode loop.
+        struct StreamedToken
         {
-            ++abs_pos;
-            ++current_pos;
+            int token;
+            int current_pos;
+        };
+        auto print_token = [&prompt_size, tokenizer = &model.Tokenizer(),
+                            verbosity](StreamedToken &streamed)
+        {
+            const int token = streamed.token;
+            const int current_pos = streamed.current_pos;
             if (current_pos < prompt_size)
             {
                 std::cerr << "." << std::flush;
             }
             else if (token == gcpp::EOS_ID)
             {
-                if (!args.multiturn)
-                {
-                    abs_pos = 0;
-                    if (args.deterministic)
-                    {
-                        gen.seed(42);
-                    }
-                }
                 if (verbosity >= 2)
                 {
                     std::cout << "\n[ End ]" << std::endl;
@@ -132,6 +284,26 @@ namespace gcpp
             }
             return true;
         };
+        // A turn streams at most max_tokens tokens, so Push() never waits.
+        AsyncConsumer<StreamedToken> printer(args.max_tokens, print_token);
+
+        // callback function invoked for each generated token.
+        auto stream_token = [&abs_pos, &current_pos, &args, &gen, &prompt_size,
+                             &printer](int token, float)
+        {
+            ++abs_pos;
+            ++current_pos;
+            if (current_pos >= prompt_size && token == gcpp::EOS_ID && !args.multiturn)
+            {
+                abs_pos = 0;
+                if (args.deterministic)
+                {
+                    gen.seed(42);
+                }
+            }
+            printer.Push({token, current_pos});
+            return true;
+        };
 
         while (abs_pos < args.max_tokens)
         {
@@ -183,6 +355,7 @@ namespace gcpp
             GenerateGemma(model, args, prompt, abs_pos, pool, inner_pool, stream_token,
                           accept_token, gen, verbosity);
             const double time_end = hwy::platform::Now();
+            printer.Drain(); // the next turn changes prompt_size
             const double tok_sec = current_pos / (time_end - time_start);
             if (verbosity >= 2)
             {
@@ -199,23 +372,22 @@ namespace gcpp
             << "command line flag.\n";
     }
 
-    void Run(LoaderArgs &loader, InferenceArgs &inference, AppArgs &app)
+    void Run(LoaderArgs &loader, InferenceArgs &inference, AppArgs &app,
+             const ThreadingArgs &threading, const PrefetchArgs &prefetch)
     {
         PROFILER_ZONE("Run.misc");
 
-        hwy::ThreadPool inner_pool(0);
-        hwy::ThreadPool pool(app.num_threads);
-        // For many-core, pinning threads to cores helps.
-        if (app.num_threads > 10)
+        std::shared_ptr<PoolSet> pools = AcquirePools(app.num_threads, threading);
+        std::unique_ptr<MappedFile> weights_file;
+        std::unique_ptr<gcpp::Gemma> loaded;
         {
-            PinThreadToCore(app.num_threads - 1); // Main thread
-
-            pool.Run(0, pool.NumThreads(),
-                     [](uint64_t /*task*/, size_t thread)
-                     { PinThreadToCore(thread); });
+            std::lock_guard<std::mutex> pools_lock(pools->Mutex());
+            weights_file = PrefetchWeights(loader, prefetch, pools->Pool(), app.verbosity);
+            // For a pool on one NUMA node, this keeps the weights on that node.
+            ScopedAffinity affinity(pools->PinCpus());
+            loaded = std::make_unique<gcpp::Gemma>(loader, pools->Pool());
         }
-
-        gcpp::Gemma model(loader, pool);
+        gcpp::Gemma &model = *loaded;
 
         if (const char *error = inference.Validate())
         {
@@ -250,147 +422,3100 @@ namespace gcpp
                       << instructions << "\n";
         }
 
-        ReplGemma(model, pool, inner_pool, inference, app.verbosity,
+        std::lock_guard<std::mutex> lock(pools->Mutex());
+        ReplGemma(model, pools->Pool(), pools->InnerPool(), inference, app.verbosity,
                   /*accept_token=*/[](int)
                   { return true; });
     }
 
-    std::string decode(gcpp::Gemma &model, hwy::ThreadPool &pool,
-                   hwy::ThreadPool &inner_pool, const InferenceArgs &args,
-                   int verbosity, const gcpp::AcceptFunc &accept_token, std::string &prompt_string) 
+    // Called with each newly decoded piece of generated text; returning false
+    // stops generation.
+    using TextStreamFunc = std::function<bool(const std::string &)>;
+    // As TextStreamFunc, for the prompt at the given index of a batch.
+    using BatchStreamFunc = std::function<bool(size_t, const std::string &)>;
+    // Asked between prefill chunks; returning true stops early so the caller
+    // can run something else first.
+    using YieldFunc = std::function<bool()>;
+
+    // Lets another thread end a request. Generation checks it on every
+    // token and between prefill chunks, and returns the text so far.
+    class CancellationToken
     {
-        std::string generated_text;
-        // Seed the random number generator
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        int prompt_size{};
-        if (model.model_training == ModelTraining::GEMMA_IT)
-            {
-                // For instruction-tuned models: add control tokens.
-                prompt_string = "<start_of_turn>user\n" + prompt_string +
-                                "<end_of_turn>\n<start_of_turn>model\n";
-            }
-        // Encode the prompt string into tokens
-        std::vector<int> prompt;
-        HWY_ASSERT(model.Tokenizer().Encode(prompt_string, &prompt).ok());
-        // Placeholder for generated token IDs
-        std::vector<int> generated_tokens;
-        // Define lambda for token decoding
-        StreamFunc stream_token = [&generated_tokens](int token, float /* probability */) -> bool {
-            generated_tokens.push_back(token);
-            return true; // Continue generating
-        };
-        // Decode tokens
-        prompt_size = prompt.size();    
-        GenerateGemma(model, args, prompt, /*start_pos=*/0, pool, inner_pool, stream_token, accept_token, gen, verbosity);
-        HWY_ASSERT(model.Tokenizer().Decode(generated_tokens, &generated_text).ok());
-        generated_text = generated_text.substr(prompt_string.size());
+    public:
+        void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+        bool Cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
 
-    return generated_text;
-    }
+    private:
+        std::atomic<bool> cancelled_{false};
+    };
 
-    std::string completion(LoaderArgs &loader, InferenceArgs &inference, AppArgs &app, std::string &prompt_string)
+    using Clock = std::chrono::steady_clock;
+
+    // When the parts of one generation happened, for benchmarks and stats.
+    struct GenerationTimes
     {
-        hwy::ThreadPool inner_pool(0);
-        hwy::ThreadPool pool(app.num_threads);
-        if (app.num_threads > 10)
-        {
-            PinThreadToCore(app.num_threads - 1); // Main thread
+        Clock::time_point received;             // before tokenization, if known
+        Clock::time_point start;                // the first Continue call
+        Clock::time_point prefill_end;          // the last prompt token was fed
+        std::vector<Clock::time_point> sampled; // each sampled token, EOS included
+        Clock::duration detokenize{};
+        size_t prompt_tokens = 0; // at the first Continue call
+        size_t cached_tokens = 0; // of those, with resident KV state
+    };
 
-            pool.Run(0, pool.NumThreads(),
-                     [](uint64_t /*task*/, size_t thread)
-                     { PinThreadToCore(thread); });
-        }
-        gcpp::Gemma model(loader, pool);
-        return decode(model, pool, inner_pool, inference, app.verbosity, /*accept_token=*/[](int)
-                  { return true; }, prompt_string);
+    // Timing of the requests it is passed to, added up when each finishes.
+    // Sampling runs inside gemma.cpp's decode step and is part of token_s.
+    struct GenerationStats
+    {
+        size_t requests = 0;
+        size_t prompt_tokens = 0;
+        size_t cached_tokens = 0; // prompt tokens whose prefill was skipped
+        size_t generated_tokens = 0;
+        double tokenize_s = 0.0;
+        double prefill_s = 0.0;    // up to the last prompt token
+        double decode_s = 0.0;     // from there to the last sampled token
+        double detokenize_s = 0.0; // part of decode_s
+        std::vector<double> token_s; // each decode step, the first from prefill_end
+    };
 
+    // Process-wide counters over all models, for monitoring.
+    struct Metrics
+    {
+        std::atomic<uint64_t> models{0};  // GemmaModels open now
+        std::atomic<uint64_t> weights{0}; // copies of the weights loaded now
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> cancelled{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> cached_tokens{0};
+        std::atomic<uint64_t> prefill_tokens{0};
+        std::atomic<uint64_t> generated_tokens{0};
+        std::atomic<uint64_t> load_ns{0};
+        std::atomic<uint64_t> prefill_ns{0};
+        std::atomic<uint64_t> decode_ns{0};
+    };
+
+    Metrics &GlobalMetrics()
+    {
+        static Metrics metrics;
+        return metrics;
     }
 
-} // namespace gcpp
+    void AddTime(std::atomic<uint64_t> &counter, Clock::duration duration)
+    {
+        counter += std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+    }
 
-void chat_base(int argc, char **argv)
-{
+    // GlobalMetrics() in the Prometheus text exposition format.
+    std::string MetricsText()
     {
-        PROFILER_ZONE("Startup.misc");
+        const Metrics &metrics = GlobalMetrics();
+        std::string text;
+        const auto add = [&text](const char *name, const char *type, const char *help,
+                                 double value)
+        {
+            char line[64];
+            snprintf(line, sizeof(line), "%.17g", value);
+            text += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " +
+                    type + "\n" + name + " " + line + "\n";
+        };
+        const auto seconds = [](const std::atomic<uint64_t> &ns)
+        { return ns.load() * 1e-9; };
+        add("pygemma_models_loaded", "gauge", "Models currently loaded.", metrics.models.load());
+        add("pygemma_weights_loaded", "gauge",
+            "Copies of model weights in memory, shared by the loaded models.",
+            metrics.weights.load());
+        add("pygemma_requests_total", "counter", "Generation requests accepted.",
+            metrics.requests.load());
+        add("pygemma_requests_cancelled_total", "counter",
+            "Requests ended by a cancellation token or deadline.", metrics.cancelled.load());
+        add("pygemma_requests_failed_total", "counter", "Generation calls that raised.",
+            metrics.failed.load());
+        add("pygemma_cached_tokens_total", "counter",
+            "Prompt tokens whose KV state was reused instead of prefilled.",
+            metrics.cached_tokens.load());
+        add("pygemma_prefill_tokens_total", "counter", "Prompt tokens prefilled.",
+            metrics.prefill_tokens.load());
+        add("pygemma_generated_tokens_total", "counter", "Tokens sampled, EOS included.",
+            metrics.generated_tokens.load());
+        add("pygemma_load_seconds_total", "counter", "Time spent loading models.",
+            seconds(metrics.load_ns));
+        add("pygemma_prefill_seconds_total", "counter", "Time spent prefilling prompts.",
+            seconds(metrics.prefill_ns));
+        add("pygemma_decode_seconds_total", "counter", "Time spent sampling tokens.",
+            seconds(metrics.decode_ns));
+        return text;
+    }
 
-        gcpp::LoaderArgs loader(argc, argv);
-        gcpp::InferenceArgs inference(argc, argv);
-        gcpp::AppArgs app(argc, argv);
+    // Peak resident set size of the process in bytes; 0 where unsupported.
+    size_t PeakRssBytes()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+        {
+            return 0;
+        }
+#if defined(__APPLE__)
+        return static_cast<size_t>(usage.ru_maxrss); // bytes
+#else
+        return static_cast<size_t>(usage.ru_maxrss) * 1024; // KiB
+#endif
+#else
+        return 0;
+#endif
+    }
 
-        if (gcpp::HasHelp(argc, argv))
+    // Per-request sampling settings; unset fields keep the model's flags.
+    struct GenerationOptions
+    {
+        std::optional<float> temperature;
+        std::optional<uint32_t> seed;
+        std::string regex; // output must match, see RegexConstraint; empty: any
+        std::optional<size_t> max_new_tokens;
+        std::vector<std::string> stop;             // see Generation::Emit
+        std::vector<std::vector<int>> stop_tokens; // token sequences
+        std::shared_ptr<CancellationToken> cancel; // optional
+        Clock::time_point deadline = Clock::time_point::max();
+        std::shared_ptr<GenerationStats> stats; // optional, see Generation::Finish
+
+        // Returns error string or nullptr if OK.
+        const char *Validate() const
         {
-            ShowHelp(loader, inference, app);
-            // return 0;
+            if (temperature && !(*temperature > 0.0f))
+            {
+                return "temperature must be positive";
+            }
+            // SampleTopK<1> is argmax: neither would change the output.
+            if (kTopK == 1 && (temperature || seed))
+            {
+                return "temperature and seed have no effect with greedy decoding "
+                       "(pygemma.top_k is 1); build with GEMMA_TOPK > 1 to sample";
+            }
+            for (const std::string &candidate : stop)
+            {
+                if (candidate.empty())
+                {
+                    return "stop strings must not be empty";
+                }
+            }
+            for (const std::vector<int> &sequence : stop_tokens)
+            {
+                if (std::any_of(sequence.begin(), sequence.end(), [](int token)
+                                { return token < 0; }))
+                {
+                    return "stop token ids must not be negative";
+                }
+            }
+            return nullptr;
         }
 
-        if (const char *error = loader.Validate())
+        // Returns `inference` with the overrides applied. Throws
+        // std::invalid_argument for values gemma.cpp cannot sample with.
+        InferenceArgs Apply(const InferenceArgs &inference) const
         {
-            ShowHelp(loader, inference, app);
-            HWY_ABORT("\nInvalid args: %s", error);
+            if (const char *error = Validate())
+            {
+                throw std::invalid_argument(error);
+            }
+            InferenceArgs args = inference;
+            if (temperature)
+            {
+                args.temperature = *temperature;
+            }
+            if (max_new_tokens)
+            {
+                args.max_generated_tokens = *max_new_tokens;
+            }
+            return args;
         }
 
-        gcpp::Run(loader, inference, app);
-    }
-    PROFILER_PRINT_RESULTS(); // Must call outside the zone above.
-    // return 1;
-}
-std::string completion_base(int argc, char **argv)
-{   
-    gcpp::LoaderArgs loader(argc, argv);
-    gcpp::InferenceArgs inference(argc, argv);
-    gcpp::AppArgs app(argc, argv);
-    std::string prompt_string = argv[argc-1];
-    return gcpp::completion(loader, inference, app, prompt_string);
-}
-std::string completion_base_wrapper(const std::vector<std::string> &args,std::string &prompt_string)
-{
-    int argc = args.size() + 2; // +1 for the program name
-    std::vector<char *> argv_vec;
-    argv_vec.reserve(argc);
+        // Seeds `gen` from `seed` if set, else like ReplGemma: 42 with
+        // --deterministic, otherwise from std::random_device.
+        void Seed(std::mt19937 &gen, const InferenceArgs &inference) const
+        {
+            if (seed)
+            {
+                gen.seed(*seed);
+            }
+            else if (inference.deterministic)
+            {
+                gen.seed(42);
+            }
+            else
+            {
+                std::random_device rd;
+                gen.seed(rd());
+            }
+        }
+    };
 
-    argv_vec.push_back(const_cast<char *>("pygemma"));
+    using StreamDecoder = BasicStreamDecoder<sentencepiece::SentencePieceProcessor>;
 
-    for (const auto &arg : args)
+    // One generation, possibly produced by several GenerateGemma calls (e.g.
+    // when a scheduler preempts it). `tokens` is the whole sequence from KV
+    // cache position 0: the prompt, then every generated token except EOS.
+    struct Generation
     {
-        argv_vec.push_back(const_cast<char *>(arg.c_str()));
-    }
-    argv_vec.push_back(const_cast<char *>(prompt_string.c_str()));
-    char **argv = argv_vec.data();
-    return completion_base(argc, argv);
-}
-void show_help_wrapper()
-{
-    // Assuming ShowHelp does not critically depend on argv content
-    gcpp::LoaderArgs loader(0, nullptr);
-    gcpp::InferenceArgs inference(0, nullptr);
-    gcpp::AppArgs app(0, nullptr);
+        Generation(std::vector<int> prompt,
+                   const sentencepiece::SentencePieceProcessor &tokenizer)
+            : tokens(std::move(prompt)), decoder(tokenizer) {}
 
-    ShowHelp(loader, inference, app);
-}
+        // Whether generation should not continue under `args`.
+        bool Done(const InferenceArgs &args) const
+        {
+            return eos || stopped || matched_stop || cancelled ||
+                   generated >= args.max_generated_tokens || tokens.size() >= args.max_tokens;
+        }
 
-std::string chat_base_wrapper(const std::vector<std::string> &args)
-{
-    int argc = args.size() + 1; // +1 for the program name
-    std::vector<char *> argv_vec;
-    argv_vec.reserve(argc);
-    argv_vec.push_back(const_cast<char *>("pygemma"));
+        // Whether the request was cancelled or ran past its deadline; sets
+        // `cancelled` if so.
+        bool CheckCancelled()
+        {
+            if (!cancelled && ((cancel && cancel->Cancelled()) ||
+                               (deadline != Clock::time_point::max() && Clock::now() >= deadline)))
+            {
+                cancelled = true;
+            }
+            return cancelled;
+        }
 
-    for (const auto &arg : args)
-    {
-        argv_vec.push_back(const_cast<char *>(arg.c_str()));
-    }
+        // Appends the text of a new token and streams what is final. Text that
+        // could be the start of a stop string is held back until it cannot.
+        // Returns false once a stop string or stop token sequence matched (the
+        // text then ends before the stop string) or the stream asked to stop.
+        bool Emit(const std::string &piece, const TextStreamFunc &stream_text)
+        {
+            const size_t old_size = text.size();
+            text += piece;
+            size_t end = text.size();
+            if (!stop.empty())
+            {
+                const size_t match = FindStop(text, stop, old_size, streamed_text);
+                if (match != std::string::npos)
+                {
+                    text.resize(match);
+                    end = match;
+                    matched_stop = true;
+                }
+                else
+                {
+                    end -= HeldBack(text, stop, streamed_text);
+                }
+            }
+            if (EndsWithStopTokens())
+            {
+                matched_stop = true;
+                end = text.size();
+            }
+            if (streamed_text == old_size && end == old_size + piece.size())
+            {
+                streamed_text = end;
+                Stream(piece, stream_text); // the common case, without a copy
+            }
+            else if (end > streamed_text)
+            {
+                const size_t begin = streamed_text;
+                streamed_text = end;
+                Stream(text.substr(begin, end - begin), stream_text);
+            }
+            return !matched_stop && !stopped;
+        }
 
-    char **argv = argv_vec.data();
+        // Emits the text the decoder and the stop matching still hold back,
+        // once no more tokens will be added, and updates `stats`.
+        void Finish(const TextStreamFunc &stream_text)
+        {
+            if (cancelled)
+            {
+                ++GlobalMetrics().cancelled;
+            }
+            FlushText(stream_text);
+            if (stats && times)
+            {
+                RecordStats();
+            }
+        }
 
-    chat_base(argc, argv);
-}
+        std::vector<int> tokens;
+        StreamDecoder decoder;                      // detokenizes the generated tokens across calls
+        std::unique_ptr<ConstraintMatcher> matcher; // restricts the generated tokens, if set
+        std::vector<int> forced;                    // if set, generated in place of sampling
+        std::vector<float> forced_probabilities;    // model probability of each forced token
+        std::vector<std::string> stop;              // stop strings, not included in `text`
+        std::vector<std::vector<int>> stop_tokens;  // stop token sequences, included
+        std::shared_ptr<CancellationToken> cancel;  // optional
+        Clock::time_point deadline = Clock::time_point::max();
+        std::unique_ptr<GenerationTimes> times;     // recorded if set
+        std::shared_ptr<GenerationStats> stats;     // updated by Finish(), requires times
+        bool allow_eos = true;                      // false: never sample EOS
+        std::string text;          // generated text so far
+        size_t streamed_text = 0;  // length of the prefix of `text` passed to the stream
+        size_t generated = 0;      // number of generated tokens, without EOS
+        bool eos = false;          // the model produced EOS
+        bool stopped = false;      // the stream callback asked to stop
+        bool matched_stop = false; // a stop string or token sequence was generated
+        bool cancelled = false;    // see CheckCancelled
+
+    private:
+        void FlushText(const TextStreamFunc &stream_text)
+        {
+            if (matched_stop || !Emit(decoder.Flush(), stream_text) ||
+                streamed_text == text.size())
+            {
+                return;
+            }
+            const size_t begin = streamed_text;
+            streamed_text = text.size();
+            Stream(text.substr(begin), stream_text);
+        }
 
+        void RecordStats() const
+        {
+            using Seconds = std::chrono::duration<double>;
+            ++stats->requests;
+            stats->generated_tokens += generated;
+            stats->detokenize_s += Seconds(times->detokenize).count();
+            if (times->start == Clock::time_point())
+            {
+                return; // cancelled before it started
+            }
+            stats->prompt_tokens += times->prompt_tokens;
+            stats->cached_tokens += times->cached_tokens;
+            if (times->received != Clock::time_point())
+            {
+                stats->tokenize_s += Seconds(times->start - times->received).count();
+            }
+            const Clock::time_point prefill_end =
+                times->prefill_end == Clock::time_point() ? Clock::now() : times->prefill_end;
+            stats->prefill_s += Seconds(prefill_end - times->start).count();
+            Clock::time_point previous = prefill_end;
+            for (const Clock::time_point sampled : times->sampled)
+            {
+                stats->token_s.push_back(Seconds(sampled - previous).count());
+                previous = sampled;
+            }
+            stats->decode_s += Seconds(previous - prefill_end).count();
+        }
 
-PYBIND11_MODULE(pygemma, m)
-{
-    m.doc() = "Pybind11 integration for chat_base function";
-    m.def("chat_base", &chat_base_wrapper, "A wrapper for the chat_base function accepting Python list of strings as arguments");
-    m.def("show_help", &show_help_wrapper, "A wrapper for show_help function");
-    m.def("completion", &completion_base_wrapper, "A wrapper for inference function");
+        void Stream(const std::string &piece, const TextStreamFunc &stream_text)
+        {
+            if (!piece.empty() && stream_text && !stopped)
+            {
+                stopped = !stream_text(piece);
+            }
+        }
+
+        bool EndsWithStopTokens() const
+        {
+            for (const std::vector<int> &sequence : stop_tokens)
+            {
+                if (!sequence.empty() && sequence.size() <= generated &&
+                    std::equal(sequence.rbegin(), sequence.rend(), tokens.rbegin()))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    // Scratch vectors for decode_tokens. A model keeps one so that their
+    // capacity is reused across requests instead of allocated for each.
+    struct DecodeBuffers
+    {
+        std::vector<int> prompt;   // the tokens GenerateGemma prefills
+        std::vector<int> streamed; // see decode_tokens
+    };
+
+    // Runs GenerateGemma on generation.tokens[start_pos:] placed at
+    // `start_pos` of the KV cache and appends the result to `generation`.
+    // buffers.streamed receives every token GenerateGemma streams back: the
+    // prompt echo, then the generated tokens. All but the last streamed token
+    // have KV state afterwards. An exception thrown by `stream_text` stops
+    // generation and is rethrown once GenerateGemma has returned.
+    void decode_tokens(gcpp::Gemma &model, hwy::ThreadPool &pool,
+                       hwy::ThreadPool &inner_pool, const InferenceArgs &args,
+                       int verbosity, const gcpp::AcceptFunc &accept_token,
+                       size_t start_pos, std::mt19937 &gen,
+                       const TextStreamFunc &stream_text, Generation &generation,
+                       DecodeBuffers &buffers)
+    {
+        // Sized up front so the token loop below does not allocate.
+        const size_t max_tokens = std::max(args.max_tokens, generation.tokens.size() + 1);
+        generation.tokens.reserve(max_tokens);
+        generation.decoder.Reserve(max_tokens);
+        std::vector<int> &prompt = buffers.prompt;
+        std::vector<int> &streamed = buffers.streamed;
+        prompt.assign(generation.tokens.begin() + start_pos, generation.tokens.end());
+        streamed.clear();
+        streamed.reserve(max_tokens - start_pos);
+        const size_t prompt_size = prompt.size();
+        size_t stream_pos = 0;
+        const Clock::time_point call_start = Clock::now();
+        Clock::time_point prefill_end = call_start;
+        std::exception_ptr error;
+        // Define lambda for token decoding. GenerateGemma first echoes the
+        // prompt tokens; only the tokens after prompt_size are detokenized,
+        // incrementally, so the prompt is never decoded again.
+        StreamFunc stream_token = [&](int token, float probability) -> bool {
+            streamed.push_back(token);
+            if (generation.CheckCancelled())
+            {
+                return false; // ends decoding; a running prefill still completes
+            }
+            if (++stream_pos <= prompt_size)
+            {
+                if (stream_pos == prompt_size)
+                {
+                    prefill_end = Clock::now();
+                    if (generation.times && generation.times->prefill_end == Clock::time_point())
+                    {
+                        generation.times->prefill_end = prefill_end;
+                    }
+                }
+                return true; // Continue generating
+            }
+            if (generation.times)
+            {
+                generation.times->sampled.push_back(Clock::now());
+            }
+            if (generation.matcher && !generation.matcher->Advance(token))
+            {
+                generation.stopped = true; // no token could continue the match
+                return false;
+            }
+            if (!generation.forced.empty())
+            {
+                if (generation.generated >= generation.forced.size() ||
+                    token != generation.forced[generation.generated])
+                {
+                    generation.stopped = true; // the forced token had probability 0
+                    return false;
+                }
+                generation.forced_probabilities.push_back(probability);
+            }
+            if (token == EOS_ID)
+            {
+                generation.eos = true;
+                return true;
+            }
+            generation.tokens.push_back(token);
+            ++generation.generated;
+            try
+            {
+                if (!generation.times)
+                {
+                    return generation.Emit(generation.decoder.Push(token), stream_text);
+                }
+                const Clock::time_point detokenize_start = Clock::now();
+                const std::string &piece = generation.decoder.Push(token);
+                generation.times->detokenize += Clock::now() - detokenize_start;
+                return generation.Emit(piece, stream_text);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+                generation.stopped = true;
+                return false;
+            }
+        };
+        GenerateGemma(model, args, prompt, start_pos, pool, inner_pool, stream_token, accept_token, gen, verbosity);
+        Metrics &metrics = GlobalMetrics();
+        metrics.prefill_tokens += prompt_size - std::min<size_t>(prompt_size, 1);
+        metrics.generated_tokens += stream_pos - std::min(stream_pos, prompt_size);
+        AddTime(metrics.prefill_ns, prefill_end - call_start);
+        if (stream_pos > prompt_size)
+        {
+            AddTime(metrics.decode_ns, Clock::now() - prefill_end);
+        }
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Tokenizes one user turn the way ReplGemma does: instruction-tuned models
+    // get the turn control tokens and a conversation starts with "<bos>".
+    std::vector<int> EncodeTurn(const gcpp::Gemma &model, std::string prompt_string,
+                                bool first_turn)
+    {
+        if (model.model_training == ModelTraining::GEMMA_IT)
+        {
+            // For instruction-tuned models: add control tokens.
+            prompt_string = "<start_of_turn>user\n" + prompt_string +
+                            "<end_of_turn>\n<start_of_turn>model\n";
+            if (!first_turn)
+            {
+                // Prepend "<end_of_turn>" token if this is a multi-turn dialogue
+                // continuation.
+                prompt_string = "<end_of_turn>\n" + prompt_string;
+            }
+        }
+        std::vector<int> prompt;
+        HWY_ASSERT(model.Tokenizer().Encode(prompt_string, &prompt).ok());
+        if (first_turn)
+        {
+            prompt.insert(prompt.begin(), 2); // <bos>
+        }
+        return prompt;
+    }
+
+    // Whether `piece` is spelled like a user-defined symbol. The processor
+    // does not expose the piece type, and in Gemma's vocabulary those
+    // symbols are the turn markers, <unusedN>, <mask> and HTML tags, all of
+    // the form <name>. Byte-fallback pieces such as <0xAB> must be checked
+    // with IsByte first.
+    bool IsSpecialPiece(const std::string &piece)
+    {
+        return piece.size() > 2 && piece.front() == '<' && piece.back() == '>' &&
+               piece.find_first_of("<>", 1) == piece.size() - 1;
+    }
+
+    // The text of every token for RegexConstraint: pieces with U+2581 as
+    // space, byte-fallback pieces as their byte, and "" for special and
+    // user-defined tokens such as <start_of_turn>, which are never allowed.
+    std::shared_ptr<const std::vector<std::string>> TokenBytes(
+        const sentencepiece::SentencePieceProcessor &tokenizer)
+    {
+        static const std::string kSpace = "\xE2\x96\x81"; // U+2581
+        auto bytes = std::make_shared<std::vector<std::string>>(tokenizer.GetPieceSize());
+        for (int id = 0; id < tokenizer.GetPieceSize(); ++id)
+        {
+            if (tokenizer.IsControl(id) || tokenizer.IsUnknown(id) || tokenizer.IsUnused(id))
+            {
+                continue;
+            }
+            const std::string &piece = tokenizer.IdToPiece(id);
+            std::string &text = (*bytes)[id];
+            if (tokenizer.IsByte(id))
+            {
+                text.push_back(static_cast<char>(strtol(piece.c_str() + 1, nullptr, 16))); // <0xAB>
+                continue;
+            }
+            if (IsSpecialPiece(piece))
+            {
+                continue;
+            }
+            for (size_t pos = 0; pos < piece.size();)
+            {
+                if (piece.compare(pos, kSpace.size(), kSpace) == 0)
+                {
+                    text.push_back(' ');
+                    pos += kSpace.size();
+                }
+                else
+                {
+                    text.push_back(piece[pos++]);
+                }
+            }
+        }
+        return bytes;
+    }
+
+    // The part of a model that GemmaModels loaded from the same files share:
+    // the weights, read once, and the thread pools they run on. gcpp::Gemma
+    // also owns the model's only KV cache, so the cache and the members that
+    // track its contents are shared too.
+    struct LoadedModel
+    {
+        LoadedModel(const LoaderArgs &loader_args, const AppArgs &app,
+                    const ThreadingArgs &threading, const PrefetchArgs &prefetch)
+            : loader(loader_args)
+        {
+            PROFILER_ZONE("Model.load");
+            const Clock::time_point load_start = Clock::now();
+            pools = AcquirePools(app.num_threads, threading);
+            {
+                std::lock_guard<std::mutex> pools_lock(pools->Mutex());
+                weights_file = PrefetchWeights(loader, prefetch, pools->Pool(), app.verbosity);
+                // For a pool on one NUMA node, this keeps the weights on that node.
+                ScopedAffinity affinity(pools->PinCpus());
+                model = std::make_unique<gcpp::Gemma>(loader, pools->Pool());
+            }
+            AddTime(GlobalMetrics().load_ns, Clock::now() - load_start);
+            ++GlobalMetrics().weights;
+        }
+
+        ~LoadedModel() { --GlobalMetrics().weights; }
+
+        LoadedModel(const LoadedModel &) = delete;
+        LoadedModel &operator=(const LoadedModel &) = delete;
+
+        LoaderArgs loader;
+        std::shared_ptr<PoolSet> pools;
+        std::unique_ptr<MappedFile> weights_file; // set for --prefetch_weights=lock
+        std::unique_ptr<gcpp::Gemma> model;       // created after the pool is pinned
+        std::mutex mutex;                         // guards generation, see GemmaModel
+        std::vector<int> kv_tokens;               // tokens with KV state at [0, size)
+        DecodeBuffers buffers;                    // guarded by mutex
+        std::mutex constraints_mutex;             // guards the two members below
+        std::shared_ptr<const std::vector<std::string>> token_bytes;
+        std::map<std::string, std::shared_ptr<const RegexConstraint>> constraints;
+    };
+
+    // Live LoadedModels, plus the state of DetachModels().
+    struct ModelRegistry
+    {
+        // (tokenizer, weights, compressed weights, model type, threads, pinned CPUs)
+        using Key = std::tuple<std::string, std::string, std::string, std::string, size_t,
+                               std::vector<size_t>>;
+
+        std::mutex mutex;
+        std::map<Key, std::weak_ptr<LoadedModel>> shared;
+        std::vector<std::weak_ptr<LoadedModel>> all; // shared or not, pruned on load
+        std::unique_lock<std::mutex> detach_lock{mutex, std::defer_lock};
+        // Kept alive and locked until reattached.
+        std::vector<std::shared_ptr<LoadedModel>> detached;
+        std::vector<std::unique_lock<std::mutex>> detached_locks;
+        std::atomic<size_t> detach_depth{0};
+    };
+
+    ModelRegistry &Models()
+    {
+        static ModelRegistry *registry = new ModelRegistry(); // outlives atexit handlers
+        return *registry;
+    }
+
+    // Returns the loaded model for these weights, tokenizer and pools,
+    // loading it unless another GemmaModel already did and `share` is set.
+    // The weights are freed with the last GemmaModel using them. Loads run
+    // one at a time, so concurrent loads of the same files load once.
+    std::shared_ptr<LoadedModel> AcquireModel(const LoaderArgs &loader, const AppArgs &app,
+                                              const ThreadingArgs &threading,
+                                              const PrefetchArgs &prefetch, bool share)
+    {
+        ModelRegistry &registry = Models();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.all.erase(std::remove_if(registry.all.begin(), registry.all.end(),
+                                          [](const std::weak_ptr<LoadedModel> &model)
+                                          { return model.expired(); }),
+                           registry.all.end());
+        if (!share)
+        {
+            std::shared_ptr<LoadedModel> loaded =
+                std::make_shared<LoadedModel>(loader, app, threading, prefetch);
+            registry.all.push_back(loaded);
+            return loaded;
+        }
+        const std::shared_ptr<PoolSet> pools = AcquirePools(app.num_threads, threading);
+        std::weak_ptr<LoadedModel> &entry = registry.shared[ModelRegistry::Key(
+            loader.tokenizer.path, loader.model.path, loader.cache.path, loader.model_type,
+            app.num_threads, pools->PinCpus())];
+        std::shared_ptr<LoadedModel> loaded = entry.lock();
+        if (!loaded)
+        {
+            loaded = std::make_shared<LoadedModel>(loader, app, threading, prefetch);
+            entry = loaded;
+            registry.all.push_back(loaded);
+        }
+        return loaded;
+    }
+
+    // DetachPools() for fork(), which first waits for every running
+    // generation by locking each LoadedModel::mutex. Generation holds that
+    // mutex across several pool locks and KV bookkeeping, so detaching the
+    // pools alone could fork between two of them and leave the mutex locked
+    // forever in the child. Loads and generation block until
+    // ReattachModels(), which must run on the same thread, in the parent or
+    // the child. Nested calls are counted.
+    void DetachModels()
+    {
+        ModelRegistry &registry = Models();
+        if (registry.detach_depth.fetch_add(1) != 0)
+        {
+            return;
+        }
+        registry.detach_lock.lock();
+        for (const std::weak_ptr<LoadedModel> &entry : registry.all)
+        {
+            if (std::shared_ptr<LoadedModel> loaded = entry.lock())
+            {
+                registry.detached_locks.emplace_back(loaded->mutex);
+                registry.detached.push_back(std::move(loaded));
+            }
+        }
+        DetachPools();
+    }
+
+    void ReattachModels()
+    {
+        ModelRegistry &registry = Models();
+        size_t depth = registry.detach_depth.load();
+        do
+        {
+            if (depth == 0)
+            {
+                return;
+            }
+        } while (!registry.detach_depth.compare_exchange_weak(depth, depth - 1));
+        if (depth != 1)
+        {
+            return;
+        }
+        ReattachPools();
+        registry.detached_locks.clear();
+        std::vector<std::shared_ptr<LoadedModel>> detached;
+        detached.swap(registry.detached);
+        registry.detach_lock.unlock();
+        // A model released meanwhile is freed here, outside the lock.
+    }
+
+    // A handle on a loaded model with its own settings: the inference,
+    // serving and app flags it was created with. GemmaModels created from
+    // the same files and threading flags share one LoadedModel, so handles
+    // with other sampling settings or system prompts add no weight memory
+    // and, after the first, load without reading the weights.
+    //
+    // Thread safety: a GemmaModel may be shared by any number of threads.
+    // gcpp::Gemma keeps a single KV cache, so Generate() calls are serialized
+    // on LoadedModel::mutex, also across the handles sharing it; as with
+    // sessions, a request that follows another handle's prefills again
+    // whatever part of its prompt was overwritten. The pools come from
+    // AcquirePools() and are shared with other models using the same
+    // threading configuration; since they run one job at a time, generation
+    // also holds the PoolSet mutex. Load models with different --cpus sets to
+    // generate in parallel. The Python bindings release the GIL while waiting
+    // for and holding these locks.
+    class GemmaModel
+    {
+    public:
+        GemmaModel(const LoaderArgs &loader, const InferenceArgs &inference,
+                   const AppArgs &app, const ThreadingArgs &threading,
+                   const PrefetchArgs &prefetch, const ServingArgs &serving,
+                   bool share_weights = true)
+            : loader_(loader), inference_(inference), app_(app), threading_(threading),
+              serving_(serving)
+        {
+            if (const char *error = loader_.Validate())
+            {
+                throw std::invalid_argument(std::string("Invalid args: ") + error);
+            }
+            if (const char *error = inference_.Validate())
+            {
+                throw std::invalid_argument(std::string("Invalid args: ") + error);
+            }
+            if (const char *error = threading_.Validate())
+            {
+                throw std::invalid_argument(std::string("Invalid args: ") + error);
+            }
+            if (const char *error = prefetch.Validate())
+            {
+                throw std::invalid_argument(std::string("Invalid args: ") + error);
+            }
+            const Clock::time_point load_start = Clock::now();
+            loaded_ = AcquireModel(loader_, app_, threading_, prefetch, share_weights);
+            {
+                std::lock_guard<std::mutex> lock(loaded_->mutex);
+                loaded_->kv_tokens.reserve(inference_.max_tokens);
+            }
+            load_time_ = Clock::now() - load_start;
+            ++GlobalMetrics().models;
+        }
+
+        ~GemmaModel() { --GlobalMetrics().models; }
+
+        GemmaModel(const GemmaModel &) = delete;
+        GemmaModel &operator=(const GemmaModel &) = delete;
+
+        // Time the constructor took to prefetch and load the weights, or to
+        // find them already loaded.
+        double LoadSeconds() const { return std::chrono::duration<double>(load_time_).count(); }
+
+        // Number of GemmaModels using these weights, this one included.
+        size_t WeightUsers() const { return loaded_.use_count(); }
+
+        // Generates a completion; if `stream_text` is set it also receives the
+        // text piece by piece as tokens are produced. Prompts that start like
+        // the previous request (e.g. a shared system prompt) only prefill the
+        // part after the common prefix.
+        std::string Generate(std::string prompt_string,
+                             const TextStreamFunc &stream_text = TextStreamFunc(),
+                             const GenerationOptions &options = GenerationOptions())
+        {
+            const Clock::time_point received = Clock::now();
+            const InferenceArgs args = options.Apply(inference_);
+            Generation generation(EncodeTurn(*loaded_->model, prompt_string, /*first_turn=*/true),
+                                  loaded_->model->Tokenizer());
+            Prepare(generation, options, received);
+            ++GlobalMetrics().requests;
+            std::mt19937 gen;
+            options.Seed(gen, args);
+            Continue(generation, args, gen, stream_text);
+            generation.Finish(stream_text);
+            return generation.text;
+        }
+
+        // Like Generate(), but on token ids for callers that tokenize
+        // themselves: `prompt` is prefilled as is, so it includes "<bos>" and
+        // any turn control tokens, and the generated tokens are returned
+        // without EOS. A stop string ends generation but stays in the tokens.
+        std::vector<int> GenerateTokens(std::vector<int> prompt,
+                                        const TextStreamFunc &stream_text = TextStreamFunc(),
+                                        const GenerationOptions &options = GenerationOptions())
+        {
+            CheckTokens(prompt);
+            if (prompt.empty())
+            {
+                throw std::invalid_argument("The prompt must contain at least one token.");
+            }
+            const InferenceArgs args = options.Apply(inference_);
+            const size_t prompt_size = prompt.size();
+            Generation generation(std::move(prompt), loaded_->model->Tokenizer());
+            Prepare(generation, options);
+            ++GlobalMetrics().requests;
+            std::mt19937 gen;
+            options.Seed(gen, args);
+            Continue(generation, args, gen, stream_text);
+            generation.Finish(stream_text);
+            generation.tokens.erase(generation.tokens.begin(),
+                                    generation.tokens.begin() + prompt_size);
+            return std::move(generation.tokens);
+        }
+
+        // Tokenizes `texts` as they are, without turn control tokens. The
+        // tokenizer is not shared with generation state, so this does not
+        // wait for running requests.
+        std::vector<std::vector<int>> Tokenize(const std::vector<std::string> &texts,
+                                               bool add_bos) const
+        {
+            std::vector<std::vector<int>> tokens(texts.size());
+            for (size_t i = 0; i < texts.size(); ++i)
+            {
+                HWY_ASSERT(loaded_->model->Tokenizer().Encode(texts[i], &tokens[i]).ok());
+                if (add_bos)
+                {
+                    tokens[i].insert(tokens[i].begin(), 2); // <bos>
+                }
+            }
+            return tokens;
+        }
+
+        // Inverse of Tokenize(). Throws std::invalid_argument for ids outside
+        // the vocabulary.
+        std::vector<std::string> Detokenize(const std::vector<std::vector<int>> &tokens) const
+        {
+            std::vector<std::string> texts(tokens.size());
+            for (size_t i = 0; i < tokens.size(); ++i)
+            {
+                CheckTokens(tokens[i]);
+                HWY_ASSERT(loaded_->model->Tokenizer().Decode(tokens[i], &texts[i]).ok());
+            }
+            return texts;
+        }
+
+        // Runs `runs` timed generations, one after the other, of
+        // max_new_tokens tokens after a prompt of prompt_length tokens. EOS
+        // is never sampled and the KV cache is dropped before each run, so
+        // every run prefills the whole prompt and decodes exactly
+        // max_new_tokens tokens (fewer only at max_tokens).
+        std::vector<GenerationTimes> Benchmark(size_t prompt_length, size_t max_new_tokens,
+                                               size_t runs)
+        {
+            if (prompt_length == 0)
+            {
+                throw std::invalid_argument("prompt_length must be positive");
+            }
+            if (runs == 0)
+            {
+                throw std::invalid_argument("runs must be positive");
+            }
+            CheckLength(prompt_length + max_new_tokens);
+            static const char kFiller[] =
+                "The quick brown fox jumps over the lazy dog while the sun sets slowly "
+                "behind the distant hills, and the river keeps flowing to the sea. ";
+            std::vector<int> filler;
+            HWY_ASSERT(loaded_->model->Tokenizer().Encode(kFiller, &filler).ok());
+            std::vector<int> prompt = {2}; // <bos>
+            while (prompt.size() < prompt_length)
+            {
+                prompt.push_back(filler[(prompt.size() - 1) % filler.size()]);
+            }
+
+            InferenceArgs args = inference_;
+            args.max_generated_tokens = max_new_tokens;
+            std::vector<GenerationTimes> results;
+            results.reserve(runs);
+            std::mt19937 gen;
+            GenerationOptions().Seed(gen, args);
+            std::lock_guard<std::mutex> lock(loaded_->mutex);
+            for (size_t i = 0; i < runs; ++i)
+            {
+                loaded_->kv_tokens.clear();
+                Generation generation(prompt, loaded_->model->Tokenizer());
+                generation.times = std::make_unique<GenerationTimes>();
+                generation.allow_eos = false;
+                ContinueLocked(generation, args, gen, TextStreamFunc());
+                results.push_back(std::move(*generation.times));
+            }
+            return results;
+        }
+
+        // Prefills the KV cache with the start of future prompts, typically a
+        // system prompt, so that requests beginning with `prefix` skip it.
+        // Returns the number of cached tokens.
+        size_t CachePrefix(std::string prefix)
+        {
+            if (loaded_->model->model_training == ModelTraining::GEMMA_IT)
+            {
+                prefix = "<start_of_turn>user\n" + prefix;
+            }
+            std::vector<int> tokens;
+            HWY_ASSERT(loaded_->model->Tokenizer().Encode(prefix, &tokens).ok());
+            tokens.insert(tokens.begin(), 2); // <bos>
+
+            // Prefill only: the last token is fed but nothing is generated.
+            // Its KV state is written by the request that continues from it.
+            InferenceArgs args = inference_;
+            args.max_generated_tokens = 0;
+            Generation generation(std::move(tokens), loaded_->model->Tokenizer());
+            std::mt19937 gen;
+            std::lock_guard<std::mutex> lock(loaded_->mutex);
+            ContinueLocked(generation, args, gen, TextStreamFunc());
+            return loaded_->kv_tokens.size();
+        }
+
+        // Bytes of KV cache state per token, see KVBytesPerToken().
+        size_t KVCacheBytesPerToken() const { return KVBytesPerToken(loader_.ModelType()); }
+
+        // Number of tokens whose KV state is currently cached.
+        size_t CachedTokens()
+        {
+            std::lock_guard<std::mutex> lock(loaded_->mutex);
+            return loaded_->kv_tokens.size();
+        }
+
+        // Continues `generation` by at most args.max_generated_tokens tokens.
+        // Only the part of generation.tokens whose KV state is no longer
+        // resident from an earlier call is prefilled, in chunks of
+        // --prefill_chunk tokens. If `yield` returns true between two chunks,
+        // returns before generating anything. The caller calls
+        // generation.Finish() once it is complete.
+        void Continue(Generation &generation, const InferenceArgs &args, std::mt19937 &gen,
+                      const TextStreamFunc &stream_text = TextStreamFunc(),
+                      const YieldFunc &yield = YieldFunc())
+        {
+            std::lock_guard<std::mutex> lock(loaded_->mutex);
+            ContinueLocked(generation, args, gen, stream_text, yield);
+        }
+
+        // Generates completions for several prompts in one call. The prompts
+        // run back to back, sorted so that prompts sharing a prefix follow each
+        // other and reuse its KV state; results are returned in input order.
+        // One generator, seeded once, samples all prompts in order.
+        std::vector<std::string> GenerateBatch(const std::vector<std::string> &prompts,
+                                               const BatchStreamFunc &stream_text = BatchStreamFunc(),
+                                               const GenerationOptions &options = GenerationOptions())
+        {
+            const InferenceArgs args = options.Apply(inference_);
+            std::vector<Generation> generations;
+            generations.reserve(prompts.size());
+            for (const std::string &prompt_string : prompts)
+            {
+                const Clock::time_point received = Clock::now();
+                generations.emplace_back(
+                    EncodeTurn(*loaded_->model, prompt_string, /*first_turn=*/true),
+                    loaded_->model->Tokenizer());
+                CheckLength(generations.back().tokens);
+                Prepare(generations.back(), options, received);
+            }
+            GlobalMetrics().requests += generations.size();
+            std::vector<size_t> order(prompts.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&generations](size_t a, size_t b)
+                      { return generations[a].tokens < generations[b].tokens; });
+
+            std::vector<std::string> results(prompts.size());
+            std::mt19937 gen;
+            options.Seed(gen, args);
+            std::lock_guard<std::mutex> lock(loaded_->mutex);
+            for (const size_t index : order)
+            {
+                TextStreamFunc stream_prompt;
+                if (stream_text)
+                {
+                    stream_prompt = [&stream_text, index](const std::string &text)
+                    { return stream_text(index, text); };
+                }
+                ContinueLocked(generations[index], args, gen, stream_prompt);
+                generations[index].Finish(stream_prompt);
+                results[index] = std::move(generations[index].text);
+            }
+            return results;
+        }
+
+        // Log-probabilities of each token of `continuation` after the prompt,
+        // as generate() would encode it. The continuation tokens are forced
+        // instead of sampled: gemma.cpp's prefill does not produce logits, so
+        // this takes one decode step per continuation token, while the prompt
+        // is prefilled once and shared by the continuations of ScoreBatch().
+        // Tokens the model gives probability 0 (and all after them) score
+        // -inf.
+        std::vector<float> Score(const std::string &prompt_string,
+                                 const std::string &continuation)
+        {
+            return ScoreBatch(prompt_string, {continuation})[0];
+        }
+
+        std::vector<std::vector<float>> ScoreBatch(const std::string &prompt_string,
+                                                   const std::vector<std::string> &continuations)
+        {
+            const std::vector<int> prompt =
+                EncodeTurn(*loaded_->model, prompt_string, /*first_turn=*/true);
+            std::vector<std::vector<int>> forced(continuations.size());
+            for (size_t i = 0; i < continuations.size(); ++i)
+            {
+                HWY_ASSERT(loaded_->model->Tokenizer().Encode(continuations[i], &forced[i]).ok());
+                CheckLength(prompt.size() + forced[i].size());
+            }
+
+            std::vector<std::vector<float>> results;
+            results.reserve(continuations.size());
+            std::mt19937 gen; // unused, nothing is sampled
+            std::lock_guard<std::mutex> lock(loaded_->mutex);
+            for (std::vector<int> &tokens : forced)
+            {
+                InferenceArgs args = inference_;
+                args.max_generated_tokens = tokens.size();
+                Generation generation(prompt, loaded_->model->Tokenizer());
+                generation.forced = std::move(tokens);
+                ContinueLocked(generation, args, gen, TextStreamFunc());
+                std::vector<float> logprobs(generation.forced.size(),
+                                            -std::numeric_limits<float>::infinity());
+                for (size_t i = 0; i < generation.forced_probabilities.size(); ++i)
+                {
+                    logprobs[i] = std::log(generation.forced_probabilities[i]);
+                }
+                results.push_back(std::move(logprobs));
+            }
+            return results;
+        }
+
+        // Applies the settings of `options` that `generation` tracks itself:
+        // stop sequences, cancellation, stats and the regex constraint.
+        // `received` is when the request arrived, before it was tokenized.
+        // Patterns are compiled once per model and shared by all requests
+        // using them. Throws std::invalid_argument for an invalid pattern.
+        void Prepare(Generation &generation, const GenerationOptions &options,
+                     Clock::time_point received = Clock::now())
+        {
+            if (options.stats)
+            {
+                generation.stats = options.stats;
+                generation.times = std::make_unique<GenerationTimes>();
+                generation.times->received = received;
+            }
+            generation.stop = options.stop;
+            generation.stop_tokens = options.stop_tokens;
+            generation.cancel = options.cancel;
+            generation.deadline = options.deadline;
+            if (options.regex.empty())
+            {
+                return;
+            }
+            std::shared_ptr<const RegexConstraint> constraint;
+            {
+                std::lock_guard<std::mutex> lock(loaded_->constraints_mutex);
+                if (!loaded_->token_bytes)
+                {
+                    loaded_->token_bytes = TokenBytes(loaded_->model->Tokenizer());
+                }
+                std::shared_ptr<const RegexConstraint> &entry = loaded_->constraints[options.regex];
+                if (!entry)
+                {
+                    entry = std::make_shared<RegexConstraint>(options.regex, loaded_->token_bytes,
+                                                              EOS_ID);
+                }
+                constraint = entry;
+            }
+            generation.matcher = std::make_unique<ConstraintMatcher>(std::move(constraint));
+        }
+
+        gcpp::Gemma &Model() { return *loaded_->model; }
+        const LoaderArgs &Loader() const { return loader_; }
+        const InferenceArgs &Inference() const { return inference_; }
+        const AppArgs &App() const { return app_; }
+        const ThreadingArgs &Threading() const { return threading_; }
+        const ServingArgs &Serving() const { return serving_; }
+
+    private:
+        void CheckLength(const std::vector<int> &tokens) const { CheckLength(tokens.size()); }
+
+        void CheckLength(size_t num_tokens) const
+        {
+            if (num_tokens >= inference_.max_tokens)
+            {
+                throw std::length_error(
+                    "max_tokens (" + std::to_string(inference_.max_tokens) +
+                    ") exceeded. Use a larger value if desired using the --max_tokens "
+                    "command line flag.");
+            }
+        }
+
+        void CheckTokens(const std::vector<int> &tokens) const
+        {
+            const int vocab_size = loaded_->model->Tokenizer().GetPieceSize();
+            for (const int token : tokens)
+            {
+                if (token < 0 || token >= vocab_size)
+                {
+                    throw std::invalid_argument("Token id " + std::to_string(token) +
+                                                " is outside the vocabulary of " +
+                                                std::to_string(vocab_size) + " tokens.");
+                }
+            }
+        }
+
+        // Requires loaded_->mutex.
+        void ContinueLocked(Generation &generation, const InferenceArgs &args,
+                            std::mt19937 &gen, const TextStreamFunc &stream_text,
+                            const YieldFunc &yield = YieldFunc())
+        {
+            PROFILER_ZONE("Model.continue");
+            CheckLength(generation.tokens);
+            if (generation.CheckCancelled())
+            {
+                return;
+            }
+            if (generation.times && generation.times->start == Clock::time_point())
+            {
+                generation.times->start = Clock::now();
+                generation.times->prompt_tokens = generation.tokens.size();
+                generation.times->cached_tokens = ResidentPrefix(generation.tokens);
+            }
+            GlobalMetrics().cached_tokens += ResidentPrefix(generation.tokens);
+            const size_t chunk = serving_.PrefillChunk();
+            // The last chunk is prefilled by the call that also generates.
+            size_t resident = ResidentPrefix(generation.tokens);
+            while (chunk != 0 && generation.tokens.size() - resident > chunk)
+            {
+                PrefillLocked(generation.tokens, resident + chunk + 1);
+                const size_t prefilled = ResidentPrefix(generation.tokens);
+                if (prefilled <= resident)
+                {
+                    break; // no progress, leave the rest to the call below
+                }
+                resident = prefilled;
+                if (generation.CheckCancelled() || (yield && yield()))
+                {
+                    return;
+                }
+            }
+            const size_t start_pos = ResidentPrefix(generation.tokens);
+            AcceptFunc accept_token = [](int)
+            { return true; };
+            if (generation.matcher)
+            {
+                const ConstraintMatcher *matcher = generation.matcher.get();
+                accept_token = [matcher](int token)
+                { return matcher->Accept(token); };
+            }
+            else if (!generation.forced.empty())
+            {
+                // The only candidate is sampled whatever the temperature.
+                const Generation *forcing = &generation;
+                accept_token = [forcing](int token)
+                {
+                    return forcing->generated < forcing->forced.size() &&
+                           token == forcing->forced[forcing->generated];
+                };
+            }
+            if (!generation.allow_eos)
+            {
+                accept_token = [accept = std::move(accept_token)](int token)
+                { return token != EOS_ID && accept(token); };
+            }
+            try
+            {
+                std::lock_guard<std::mutex> pools_lock(loaded_->pools->Mutex());
+                decode_tokens(*loaded_->model, loaded_->pools->Pool(), loaded_->pools->InnerPool(),
+                              args, app_.verbosity, accept_token, start_pos, gen, stream_text,
+                              generation, loaded_->buffers);
+            }
+            catch (...)
+            {
+                ++GlobalMetrics().failed;
+                SetResident(start_pos, loaded_->buffers.streamed);
+                throw;
+            }
+            SetResident(start_pos, loaded_->buffers.streamed);
+        }
+
+        // Fills the KV cache for tokens[ResidentPrefix, end - 1) in one
+        // GenerateGemma call that samples nothing. Requires loaded_->mutex.
+        void PrefillLocked(const std::vector<int> &tokens, size_t end)
+        {
+            PROFILER_ZONE("Model.prefill");
+            const Clock::time_point prefill_start = Clock::now();
+            InferenceArgs args = inference_;
+            args.max_generated_tokens = 0;
+            const size_t start_pos = ResidentPrefix(tokens);
+            loaded_->buffers.prompt.assign(tokens.begin() + start_pos, tokens.begin() + end);
+            loaded_->buffers.streamed.clear();
+            std::mt19937 gen; // unused, nothing is sampled
+            const StreamFunc stream_token = [this](int token, float /* probability */)
+            {
+                loaded_->buffers.streamed.push_back(token);
+                return true;
+            };
+            try
+            {
+                std::lock_guard<std::mutex> pools_lock(loaded_->pools->Mutex());
+                GenerateGemma(*loaded_->model, args, loaded_->buffers.prompt, start_pos,
+                              loaded_->pools->Pool(), loaded_->pools->InnerPool(), stream_token, /*accept_token=*/[](int)
+                              { return true; }, gen, app_.verbosity);
+            }
+            catch (...)
+            {
+                ++GlobalMetrics().failed;
+                SetResident(start_pos, loaded_->buffers.streamed);
+                throw;
+            }
+            SetResident(start_pos, loaded_->buffers.streamed);
+            GlobalMetrics().prefill_tokens += loaded_->buffers.prompt.size() - 1;
+            AddTime(GlobalMetrics().prefill_ns, Clock::now() - prefill_start);
+        }
+
+        // Length of the longest prefix of `tokens` with resident KV state,
+        // leaving at least one token for GenerateGemma to start from.
+        size_t ResidentPrefix(const std::vector<int> &tokens) const
+        {
+            const size_t limit = std::min(loaded_->kv_tokens.size(), tokens.size() - 1);
+            size_t length = 0;
+            while (length < limit && loaded_->kv_tokens[length] == tokens[length])
+            {
+                ++length;
+            }
+            return length;
+        }
+
+        void SetResident(size_t start_pos, const std::vector<int> &streamed)
+        {
+            loaded_->kv_tokens.resize(start_pos);
+            if (!streamed.empty())
+            {
+                loaded_->kv_tokens.insert(loaded_->kv_tokens.end(), streamed.begin(),
+                                          streamed.end() - 1);
+            }
+        }
+
+        LoaderArgs loader_;
+        InferenceArgs inference_;
+        AppArgs app_;
+        ThreadingArgs threading_;
+        ServingArgs serving_;
+        std::shared_ptr<LoadedModel> loaded_;
+        Clock::duration load_time_{};
+    };
+
+    // A multi-turn conversation on a GemmaModel. Like abs_pos in ReplGemma,
+    // each turn continues from the KV cache of the previous ones instead of
+    // prefilling the whole conversation again. If other requests used the
+    // model in between, the overwritten part of the conversation is prefilled
+    // again, so sessions stay correct when they share a model.
+    //
+    // A system prompt opens the first user turn and stays at the start of
+    // the conversation. With `sliding_window`, a turn that would not fit in
+    // --max_tokens evicts the oldest turns after the system prompt instead of
+    // failing. gemma.cpp keeps the KV cache to itself and bakes positions
+    // into the keys, so the cache cannot be compacted in place: the system
+    // prompt stays resident and the turns kept after it are prefilled again,
+    // once per eviction.
+    class GemmaSession
+    {
+    public:
+        explicit GemmaSession(std::shared_ptr<GemmaModel> model,
+                              std::string system_prompt = std::string(),
+                              bool sliding_window = false)
+            : model_(std::move(model)), system_prompt_(std::move(system_prompt)),
+              sliding_window_(sliding_window)
+        {
+            if (model_->Model().model_training == ModelTraining::GEMMA_IT)
+            {
+                HWY_ASSERT(model_->Model().Tokenizer().Encode("<end_of_turn>\n", &close_turn_).ok());
+            }
+            Reset();
+        }
+
+        // Sends one user turn and returns the model's reply. A seed in
+        // `options` restarts the session's generator for this turn.
+        std::string Send(std::string message,
+                         const TextStreamFunc &stream_text = TextStreamFunc(),
+                         const GenerationOptions &options = GenerationOptions())
+        {
+            const Clock::time_point received = Clock::now();
+            const InferenceArgs args = options.Apply(model_->Inference());
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (options.seed)
+            {
+                options.Seed(gen_, args);
+            }
+            std::vector<int> turn = EncodeMessage(message);
+            if (sliding_window_ && !turn_starts_.empty())
+            {
+                // Leave room for the reply, but at most half the context.
+                const size_t max_tokens = model_->Inference().max_tokens;
+                Evict(turn.size() + std::min(args.max_generated_tokens, max_tokens / 2));
+                if (turn_starts_.empty())
+                {
+                    turn = EncodeMessage(message); // now the first turn again
+                }
+            }
+            std::vector<int> tokens = tokens_;
+            tokens.insert(tokens.end(), turn.begin(), turn.end());
+            Generation generation(std::move(tokens), model_->Model().Tokenizer());
+            model_->Prepare(generation, options, received);
+            ++GlobalMetrics().requests;
+            model_->Continue(generation, args, gen_, stream_text);
+            generation.Finish(stream_text);
+            if (tokens_.empty())
+            {
+                pinned_ = 1; // the first turn started with <bos>
+            }
+            turn_starts_.push_back(std::max(tokens_.size(), pinned_));
+            tokens_ = std::move(generation.tokens);
+            return generation.text;
+        }
+
+        // Starts a new conversation with the same system prompt.
+        void Reset()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tokens_.clear();
+            turn_starts_.clear();
+            evicted_ = 0;
+            if (!system_prompt_.empty())
+            {
+                std::string prefix = system_prompt_ + "\n\n";
+                if (model_->Model().model_training == ModelTraining::GEMMA_IT)
+                {
+                    prefix = "<start_of_turn>user\n" + prefix;
+                }
+                HWY_ASSERT(model_->Model().Tokenizer().Encode(prefix, &tokens_).ok());
+                tokens_.insert(tokens_.begin(), 2); // <bos>
+            }
+            pinned_ = tokens_.size();
+            GenerationOptions().Seed(gen_, model_->Inference());
+        }
+
+        // Number of tokens dropped by the sliding window since Reset().
+        size_t EvictedTokens()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return evicted_;
+        }
+
+        // Number of tokens in the conversation so far.
+        size_t Position()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return tokens_.size();
+        }
+
+    private:
+        // Tokenizes a user turn. The first one continues the user turn the
+        // system prompt opened. Requires mutex_.
+        std::vector<int> EncodeMessage(const std::string &message) const
+        {
+            if (system_prompt_.empty() || !turn_starts_.empty())
+            {
+                std::vector<int> turn = EncodeTurn(model_->Model(), message, turn_starts_.empty());
+                if (turn_starts_.empty() && !tokens_.empty())
+                {
+                    turn.erase(turn.begin()); // <bos> was kept by the sliding window
+                }
+                return turn;
+            }
+            std::string text = message;
+            if (model_->Model().model_training == ModelTraining::GEMMA_IT)
+            {
+                text += "<end_of_turn>\n<start_of_turn>model\n";
+            }
+            std::vector<int> turn;
+            HWY_ASSERT(model_->Model().Tokenizer().Encode(text, &turn).ok());
+            return turn;
+        }
+
+        // Drops the oldest turns after the system prompt until `needed` more
+        // tokens fit in --max_tokens. Requires mutex_.
+        void Evict(size_t needed)
+        {
+            const size_t max_tokens = model_->Inference().max_tokens;
+            size_t drop = 0; // turns
+            while (drop < turn_starts_.size() &&
+                   tokens_.size() - (turn_starts_[drop] - pinned_) + needed >= max_tokens)
+            {
+                ++drop;
+            }
+            if (drop == 0)
+            {
+                return;
+            }
+            // The oldest kept turn, or the end if all are dropped.
+            size_t end = drop < turn_starts_.size() ? turn_starts_[drop] : tokens_.size();
+            if (system_prompt_.empty() && tokens_.size() - end >= close_turn_.size() &&
+                std::equal(close_turn_.begin(), close_turn_.end(), tokens_.begin() + end))
+            {
+                // Without a system prompt no turn is open before it.
+                end += close_turn_.size();
+            }
+            tokens_.erase(tokens_.begin() + pinned_, tokens_.begin() + end);
+            evicted_ += end - pinned_;
+            turn_starts_.erase(turn_starts_.begin(), turn_starts_.begin() + drop);
+            for (size_t &start : turn_starts_)
+            {
+                start = start > end ? start - (end - pinned_) : pinned_;
+            }
+        }
+
+        std::shared_ptr<GemmaModel> model_;
+        const std::string system_prompt_;
+        const bool sliding_window_;
+        std::vector<int> close_turn_; // "<end_of_turn>\n" that starts later turns
+        std::vector<int> tokens_;     // conversation so far, from position 0
+        size_t pinned_ = 0;           // <bos> and system prompt, never evicted
+        std::vector<size_t> turn_starts_; // in tokens_, one per turn after pinned_
+        size_t evicted_ = 0;
+        std::mt19937 gen_;
+        std::mutex mutex_;
+    };
+
+    // Completion state of a request submitted to a GemmaEngine.
+    class EngineResult
+    {
+    public:
+        // Waits until the request has finished, at most `timeout_s` seconds if
+        // it is not negative. Returns whether the request has finished.
+        bool Wait(double timeout_s)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (timeout_s < 0)
+            {
+                done_cv_.wait(lock, [this]
+                              { return done_; });
+                return true;
+            }
+            return done_cv_.wait_for(lock, std::chrono::duration<double>(timeout_s),
+                                     [this]
+                                     { return done_; });
+        }
+
+        bool Done()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return done_;
+        }
+
+        // Returns the generated text of a finished request, or rethrows the
+        // error that ended it.
+        std::string Text()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (error_)
+            {
+                std::rethrow_exception(error_);
+            }
+            return text_;
+        }
+
+        // Cancels the request; it finishes with the text generated so far.
+        void Cancel() { cancel_->Cancel(); }
+
+        const std::shared_ptr<CancellationToken> &Token() const { return cancel_; }
+        void SetToken(std::shared_ptr<CancellationToken> cancel) { cancel_ = std::move(cancel); }
+
+        // Called on the engine's threads once the request has finished. Set
+        // before the request is queued.
+        void SetOnFinish(std::function<void()> on_finish) { on_finish_ = std::move(on_finish); }
+
+        void Finish(std::string text, std::exception_ptr error)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                text_ = std::move(text);
+                error_ = error;
+                done_ = true;
+            }
+            done_cv_.notify_all();
+            if (on_finish_)
+            {
+                on_finish_();
+            }
+        }
+
+    private:
+        std::mutex mutex_;
+        std::condition_variable done_cv_;
+        bool done_ = false;
+        std::string text_;
+        std::exception_ptr error_;
+        std::shared_ptr<CancellationToken> cancel_ = std::make_shared<CancellationToken>();
+        std::function<void()> on_finish_;
+    };
+
+    // Serves requests from many threads with one engine thread per model.
+    // Requests wait in a queue of at most max_queue_depth entries, ordered by
+    // priority (higher first, FIFO among equals). With time_slice > 0 the
+    // running request yields after every time_slice generated tokens to the
+    // waiting requests of at least its priority, so a long generation cannot
+    // block everything behind it; a preempted request later resumes where it
+    // stopped, prefilling whatever of its KV state was overwritten meanwhile.
+    // Yielding with nothing else waiting costs nothing extra.
+    //
+    // Stream callbacks run on a second thread: the engine thread only queues
+    // the text in an AsyncConsumer, so a slow consumer delays its own request
+    // (and, once it is a whole ring behind, the engine) instead of every
+    // request being time-sliced. A request with a stream finishes on that
+    // thread too, after its last piece of text.
+    class GemmaEngine
+    {
+    public:
+        GemmaEngine(std::shared_ptr<GemmaModel> model, size_t max_queue_depth,
+                    size_t time_slice)
+            : model_(std::move(model)), max_queue_depth_(max_queue_depth),
+              time_slice_(time_slice),
+              streams_(kStreamCapacity, [this](StreamEvent &event)
+                       { return Dispatch(event); }),
+              thread_([this]
+                      { Loop(); }) {}
+
+        GemmaEngine(const GemmaEngine &) = delete;
+        GemmaEngine &operator=(const GemmaEngine &) = delete;
+
+        ~GemmaEngine() { Stop(); }
+
+        // Queues a prompt and returns immediately. `stream_text` is called on
+        // the engine's stream thread and `on_finish` (see
+        // EngineResult::SetOnFinish) on the thread that finishes the request.
+        // Throws if the queue is full or the engine stopped.
+        std::shared_ptr<EngineResult> Submit(std::string prompt_string, int priority,
+                                             TextStreamFunc stream_text = TextStreamFunc(),
+                                             const GenerationOptions &options = GenerationOptions(),
+                                             std::function<void()> on_finish = std::function<void()>())
+        {
+            const Clock::time_point received = Clock::now();
+            const InferenceArgs args = options.Apply(model_->Inference());
+            auto request = std::make_shared<Request>(
+                EncodeTurn(model_->Model(), prompt_string, /*first_turn=*/true),
+                model_->Model().Tokenizer());
+            request->priority = priority;
+            request->stream_text = std::move(stream_text);
+            request->options = options;
+            if (options.cancel)
+            {
+                request->result->SetToken(options.cancel);
+            }
+            request->options.cancel = request->result->Token(); // for Request.cancel()
+            request->result->SetOnFinish(std::move(on_finish));
+            options.Seed(request->gen, args);
+            model_->Prepare(*request, request->options, received);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stopped_)
+                {
+                    throw std::runtime_error("engine is stopped");
+                }
+                if (queue_.size() >= max_queue_depth_)
+                {
+                    throw std::runtime_error("request queue is full (max_queue_depth " +
+                                             std::to_string(max_queue_depth_) + ")");
+                }
+                request->sequence = next_sequence_++;
+                queue_.push(request);
+            }
+            ++GlobalMetrics().requests; // only once accepted
+            queue_cv_.notify_one();
+            return request->result;
+        }
+
+        // Number of requests waiting, not counting the running one.
+        size_t QueueDepth()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return queue_.size();
+        }
+
+        // Stops the engine thread. The running request and all queued ones
+        // finish with an error.
+        void Stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopped_ = true;
+            }
+            queue_cv_.notify_one();
+            if (thread_.joinable())
+            {
+                thread_.join();
+            }
+        }
+
+    private:
+        struct Request : public Generation
+        {
+            using Generation::Generation;
+
+            int priority = 0;
+            uint64_t sequence = 0; // admission order, breaks priority ties
+            TextStreamFunc stream_text;
+            GenerationOptions options;
+            std::mt19937 gen;
+            std::shared_ptr<EngineResult> result = std::make_shared<EngineResult>();
+            std::atomic<bool> stream_stopped{false}; // stream_text returned false or threw
+            std::exception_ptr stream_error;         // only touched by the stream thread
+        };
+
+        // Text for a request's stream_text, or with `finish` the end of the
+        // request once all its text was streamed.
+        struct StreamEvent
+        {
+            std::shared_ptr<Request> request;
+            std::string text;
+            bool finish = false;
+            std::exception_ptr error;
+        };
+
+        static constexpr size_t kStreamCapacity = 1 << 14; // pieces streams may lag behind
+
+        struct LowerPriority
+        {
+            bool operator()(const std::shared_ptr<Request> &a,
+                            const std::shared_ptr<Request> &b) const
+            {
+                return a->priority != b->priority ? a->priority < b->priority
+                                                  : a->sequence > b->sequence;
+            }
+        };
+
+        void Loop()
+        {
+            for (;;)
+            {
+                std::shared_ptr<Request> request;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    queue_cv_.wait(lock, [this]
+                                   { return stopped_ || !queue_.empty(); });
+                    if (stopped_)
+                    {
+                        break;
+                    }
+                    request = queue_.top();
+                    queue_.pop();
+                }
+                if (!RunSlice(request))
+                {
+                    // Requeue behind the waiting requests of the same priority.
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    request->sequence = next_sequence_++;
+                    queue_.push(std::move(request));
+                }
+            }
+
+            const auto stopped = std::make_exception_ptr(std::runtime_error("engine is stopped"));
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (; !queue_.empty(); queue_.pop())
+            {
+                FinishRequest(queue_.top(), std::string(), stopped);
+            }
+        }
+
+        // Runs `request` for up to one time slice. Returns whether it finished.
+        bool RunSlice(const std::shared_ptr<Request> &shared_request)
+        {
+            Request &request = *shared_request;
+            const InferenceArgs args = request.options.Apply(model_->Inference());
+            InferenceArgs slice_args = args;
+            slice_args.max_generated_tokens = args.max_generated_tokens - request.generated;
+            if (time_slice_ > 0)
+            {
+                slice_args.max_generated_tokens =
+                    std::min(slice_args.max_generated_tokens, time_slice_);
+            }
+            const TextStreamFunc stream_text = [this, &shared_request](const std::string &text)
+            {
+                if (shared_request->stream_text)
+                {
+                    streams_.Push(StreamEvent{shared_request, text});
+                }
+                return !shared_request->stream_stopped.load(std::memory_order_relaxed) &&
+                       !Stopped();
+            };
+            // With a single KV cache, yielding a partly prefilled prompt loses
+            // that work, so only strictly higher priorities may cut in.
+            YieldFunc yield;
+            if (time_slice_ > 0)
+            {
+                yield = [this, &request]
+                { return Stopped() || HigherPriorityWaiting(request.priority); };
+            }
+            try
+            {
+                model_->Continue(request, slice_args, request.gen, stream_text, yield);
+                if (Stopped())
+                {
+                    throw std::runtime_error("engine is stopped");
+                }
+                if (!request.Done(args))
+                {
+                    return false;
+                }
+                request.Finish(stream_text);
+                FinishRequest(shared_request, std::move(request.text), nullptr);
+            }
+            catch (...)
+            {
+                FinishRequest(shared_request, std::string(), std::current_exception());
+            }
+            return true;
+        }
+
+        // Finishes `request` behind the text queued for its stream, if any.
+        // Engine thread only.
+        void FinishRequest(const std::shared_ptr<Request> &request, std::string text,
+                           std::exception_ptr error)
+        {
+            if (!request->stream_text)
+            {
+                request->result->Finish(std::move(text), error);
+                return;
+            }
+            streams_.Push(StreamEvent{request, std::move(text), /*finish=*/true, error});
+        }
+
+        // Runs on the stream thread. An exception thrown by stream_text
+        // stops the request and becomes its error.
+        bool Dispatch(StreamEvent &event)
+        {
+            Request &request = *event.request;
+            if (event.finish)
+            {
+                const std::exception_ptr error = event.error ? event.error : request.stream_error;
+                request.result->Finish(error ? std::string() : std::move(event.text), error);
+            }
+            else if (!request.stream_stopped.load(std::memory_order_relaxed))
+            {
+                try
+                {
+                    if (!request.stream_text(event.text))
+                    {
+                        request.stream_stopped.store(true, std::memory_order_relaxed);
+                    }
+                }
+                catch (...)
+                {
+                    request.stream_error = std::current_exception();
+                    request.stream_stopped.store(true, std::memory_order_relaxed);
+                }
+            }
+            event.request.reset(); // release it now, not when the ring slot is reused
+            return true;
+        }
+
+        bool Stopped()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return stopped_;
+        }
+
+        bool HigherPriorityWaiting(int priority)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return !queue_.empty() && queue_.top()->priority > priority;
+        }
+
+        std::shared_ptr<GemmaModel> model_;
+        const size_t max_queue_depth_;
+        const size_t time_slice_;
+        std::mutex mutex_; // guards the members below
+        std::condition_variable queue_cv_;
+        std::priority_queue<std::shared_ptr<Request>, std::vector<std::shared_ptr<Request>>,
+                            LowerPriority>
+            queue_;
+        uint64_t next_sequence_ = 0;
+        bool stopped_ = false;
+        AsyncConsumer<StreamEvent> streams_; // fed by thread_ only, joined after it
+        std::thread thread_; // last, starts once the members above exist
+    };
+
+    std::string completion(LoaderArgs &loader, InferenceArgs &inference, AppArgs &app,
+                           ThreadingArgs &threading, PrefetchArgs &prefetch,
+                           ServingArgs &serving, std::string &prompt_string)
+    {
+        PROFILER_ZONE("Completion.misc");
+        GemmaModel model(loader, inference, app, threading, prefetch, serving);
+        return model.Generate(prompt_string);
+    }
+
+} // namespace gcpp
+
+void chat_base(int argc, char **argv)
+{
+    {
+        PROFILER_ZONE("Startup.misc");
+
+        gcpp::LoaderArgs loader(argc, argv);
+        gcpp::InferenceArgs inference(argc, argv);
+        gcpp::AppArgs app(argc, argv);
+        gcpp::ThreadingArgs threading(argc, argv);
+        gcpp::PrefetchArgs prefetch(argc, argv);
+        gcpp::DefaultNumThreads(argc, argv, app, threading);
+
+        if (gcpp::HasHelp(argc, argv))
+        {
+            ShowHelp(loader, inference, app);
+            // return 0;
+        }
+
+        if (const char *error = loader.Validate())
+        {
+            ShowHelp(loader, inference, app);
+            HWY_ABORT("\nInvalid args: %s", error);
+        }
+
+        if (const char *error = threading.Validate())
+        {
+            ShowHelp(loader, inference, app);
+            HWY_ABORT("\nInvalid args: %s", error);
+        }
+
+        if (const char *error = prefetch.Validate())
+        {
+            ShowHelp(loader, inference, app);
+            HWY_ABORT("\nInvalid args: %s", error);
+        }
+
+        gcpp::Run(loader, inference, app, threading, prefetch);
+    }
+    PROFILER_PRINT_RESULTS(); // Must call outside the zone above.
+    // return 1;
+}
+std::string completion_base(int argc, char **argv)
+{   
+    gcpp::LoaderArgs loader(argc, argv);
+    gcpp::InferenceArgs inference(argc, argv);
+    gcpp::AppArgs app(argc, argv);
+    gcpp::ThreadingArgs threading(argc, argv);
+    gcpp::PrefetchArgs prefetch(argc, argv);
+    gcpp::ServingArgs serving(argc, argv);
+    gcpp::DefaultNumThreads(argc, argv, app, threading);
+    std::string prompt_string = argv[argc-1];
+    return gcpp::completion(loader, inference, app, threading, prefetch, serving,
+                            prompt_string);
+}
+// Builds a "pygemma <args...>" argv for the gemma.cpp argument parsers. The
+// pointers refer into `args`, which must outlive the returned vector.
+std::vector<char *> make_argv(const std::vector<std::string> &args)
+{
+    std::vector<char *> argv_vec;
+    argv_vec.reserve(args.size() + 1); // +1 for the program name
+    argv_vec.push_back(const_cast<char *>("pygemma"));
+
+    for (const auto &arg : args)
+    {
+        argv_vec.push_back(const_cast<char *>(arg.c_str()));
+    }
+    return argv_vec;
+}
+std::string completion_base_wrapper(const std::vector<std::string> &args,std::string &prompt_string)
+{
+    std::vector<char *> argv_vec = make_argv(args);
+    argv_vec.push_back(const_cast<char *>(prompt_string.c_str()));
+    int argc = argv_vec.size();
+    char **argv = argv_vec.data();
+    return completion_base(argc, argv);
+}
+// Converts generated text to a Python str. Pieces end on character
+// boundaries, but replace anything malformed rather than raising mid-stream.
+py::str to_py_str(const std::string &text)
+{
+    PyObject *str = PyUnicode_DecodeUTF8(text.data(), text.size(), "replace");
+    if (!str)
+    {
+        throw py::error_already_set();
+    }
+    return py::reinterpret_steal<py::str>(str);
+}
+
+// Adapts an optional Python callable to gcpp::TextStreamFunc. The callable
+// runs with the GIL re-acquired; a None/True result continues generation and a
+// False result stops it. An exception stops generation and is re-raised by
+// Rethrow() once the native call has returned.
+//
+// The callable runs on a consumer thread of its own: the decode loop only
+// queues the text, so a slow callback or a busy GIL does not delay the next
+// token. A callback returning False therefore stops generation a token or
+// so later. Must be used and destroyed with the GIL released.
+class PyTextStream
+{
+public:
+    explicit PyTextStream(const py::object &callback) : callback_(callback) {}
+
+    gcpp::TextStreamFunc Func()
+    {
+        if (callback_.is_none())
+        {
+            return gcpp::TextStreamFunc();
+        }
+        Start(false);
+        return [this](const std::string &text)
+        { return consumer_->Push({0, text}); };
+    }
+
+    // For batches the callable receives (index, text).
+    gcpp::BatchStreamFunc BatchFunc()
+    {
+        if (callback_.is_none())
+        {
+            return gcpp::BatchStreamFunc();
+        }
+        Start(true);
+        return [this](size_t index, const std::string &text)
+        { return consumer_->Push({index, text}); };
+    }
+
+    // Waits until the callable has received all text, then rethrows what it
+    // raised, if anything.
+    void Rethrow()
+    {
+        if (consumer_)
+        {
+            consumer_->Drain();
+        }
+        if (error_)
+        {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    struct Piece
+    {
+        size_t index;
+        std::string text;
+    };
+
+    void Start(bool batch)
+    {
+        consumer_ = std::make_unique<gcpp::AsyncConsumer<Piece>>(
+            kCapacity, [this, batch](Piece &piece)
+            {
+                py::gil_scoped_acquire acquire;
+                return batch ? Call(piece.index, to_py_str(piece.text))
+                             : Call(to_py_str(piece.text)); });
+    }
+
+    static constexpr size_t kCapacity = 4096; // pieces the callable may lag behind
+
+    template <class... Args>
+    bool Call(Args &&...args)
+    {
+        if (error_)
+        {
+            return false; // a previous call raised; stop everything else too
+        }
+        try
+        {
+            py::object result = callback_(std::forward<Args>(args)...);
+            return result.is_none() || result.cast<bool>();
+        }
+        catch (...)
+        {
+            error_ = std::current_exception();
+            return false;
+        }
+    }
+
+    const py::object &callback_; // owned by the caller, which holds a reference
+    std::exception_ptr error_;   // written by the consumer thread
+    std::unique_ptr<gcpp::AsyncConsumer<Piece>> consumer_; // last, joined first
+};
+
+// Per-request keyword arguments shared by all generation methods.
+using StopList = std::optional<std::vector<std::string>>;
+using StopTokenList = std::optional<std::vector<std::vector<int>>>;
+
+// Generation settings bound as pygemma.GenerationConfig, so that they are
+// converted from Python and validated once and then reused by any number of
+// requests. The deadline stays relative and starts with each request.
+struct GenerationConfig
+{
+    gcpp::GenerationOptions options; // without cancel and deadline
+    std::optional<double> deadline_ms;
+};
+
+void check_config(const GenerationConfig &config)
+{
+    if (const char *error = config.options.Validate())
+    {
+        throw std::invalid_argument(error);
+    }
+    if (!config.options.regex.empty())
+    {
+        gcpp::RegexConstraint::CheckPattern(config.options.regex);
+    }
+}
+
+// Options for one request: `config` if given, with the keyword arguments
+// that are set taking precedence.
+gcpp::GenerationOptions make_options(std::optional<float> temperature,
+                                     std::optional<uint32_t> seed,
+                                     std::optional<std::string> regex,
+                                     std::optional<size_t> max_new_tokens, StopList stop,
+                                     StopTokenList stop_tokens,
+                                     std::shared_ptr<gcpp::CancellationToken> cancel,
+                                     std::optional<double> deadline_ms,
+                                     const std::optional<GenerationConfig> &config = std::nullopt,
+                                     std::shared_ptr<gcpp::GenerationStats> stats = nullptr)
+{
+    gcpp::GenerationOptions options;
+    if (config)
+    {
+        options = config->options;
+        if (!deadline_ms)
+        {
+            deadline_ms = config->deadline_ms;
+        }
+    }
+    if (temperature)
+    {
+        options.temperature = temperature;
+    }
+    if (seed)
+    {
+        options.seed = seed;
+    }
+    if (regex)
+    {
+        options.regex = std::move(*regex);
+    }
+    if (max_new_tokens)
+    {
+        options.max_new_tokens = max_new_tokens;
+    }
+    if (stop)
+    {
+        options.stop = std::move(*stop);
+    }
+    if (stop_tokens)
+    {
+        options.stop_tokens = std::move(*stop_tokens);
+    }
+    options.cancel = std::move(cancel);
+    options.stats = std::move(stats);
+    if (deadline_ms)
+    {
+        options.deadline = gcpp::Clock::now() +
+                           std::chrono::duration_cast<gcpp::Clock::duration>(
+                               std::chrono::duration<double, std::milli>(*deadline_ms));
+    }
+    return options;
+}
+
+GenerationConfig make_config(std::optional<float> temperature, std::optional<uint32_t> seed,
+                             std::optional<std::string> regex,
+                             std::optional<size_t> max_new_tokens, StopList stop,
+                             StopTokenList stop_tokens, std::optional<double> deadline_ms)
+{
+    GenerationConfig config;
+    config.options = make_options(temperature, seed, std::move(regex), max_new_tokens,
+                                  std::move(stop), std::move(stop_tokens), nullptr,
+                                  std::nullopt);
+    config.deadline_ms = deadline_ms;
+    check_config(config);
+    return config;
+}
+
+// Applies `set` to a copy of `config` and keeps the result only if valid.
+template <class Set>
+void update_config(GenerationConfig &config, const Set &set)
+{
+    GenerationConfig updated = config;
+    set(updated);
+    check_config(updated);
+    config = std::move(updated);
+}
+
+std::string generate_wrapper(gcpp::GemmaModel &model, std::string prompt_string,
+                             const py::object &stream, std::optional<float> temperature,
+                             std::optional<uint32_t> seed, std::optional<std::string> regex,
+                             std::optional<size_t> max_new_tokens, StopList stop,
+                             StopTokenList stop_tokens,
+                             std::shared_ptr<gcpp::CancellationToken> cancel,
+                             std::optional<double> deadline_ms,
+                             std::optional<GenerationConfig> config,
+                             std::shared_ptr<gcpp::GenerationStats> stats)
+{
+    const gcpp::GenerationOptions options =
+        make_options(temperature, seed, regex, max_new_tokens, stop, stop_tokens,
+                     std::move(cancel), deadline_ms, config,
+                     std::move(stats));
+    PyTextStream stream_text(stream);
+    std::string text = model.Generate(prompt_string, stream_text.Func(), options);
+    stream_text.Rethrow();
+    return text;
+}
+
+std::vector<std::string> generate_batch_wrapper(gcpp::GemmaModel &model,
+                                                const std::vector<std::string> &prompts,
+                                                const py::object &stream,
+                                                std::optional<float> temperature,
+                                                std::optional<uint32_t> seed,
+                                                std::optional<std::string> regex,
+                                                std::optional<size_t> max_new_tokens, StopList stop,
+                                                StopTokenList stop_tokens,
+                                                std::shared_ptr<gcpp::CancellationToken> cancel,
+                                                std::optional<double> deadline_ms,
+                                                std::optional<GenerationConfig> config,
+                                                std::shared_ptr<gcpp::GenerationStats> stats)
+{
+    const gcpp::GenerationOptions options =
+        make_options(temperature, seed, regex, max_new_tokens, stop, stop_tokens,
+                     std::move(cancel), deadline_ms, config,
+                     std::move(stats));
+    PyTextStream stream_text(stream);
+    std::vector<std::string> texts = model.GenerateBatch(prompts, stream_text.BatchFunc(), options);
+    stream_text.Rethrow();
+    return texts;
+}
+
+std::string send_wrapper(gcpp::GemmaSession &session, std::string message,
+                         const py::object &stream, std::optional<float> temperature,
+                         std::optional<uint32_t> seed, std::optional<std::string> regex,
+                         std::optional<size_t> max_new_tokens, StopList stop,
+                         StopTokenList stop_tokens,
+                         std::shared_ptr<gcpp::CancellationToken> cancel,
+                         std::optional<double> deadline_ms,
+                         std::optional<GenerationConfig> config,
+                         std::shared_ptr<gcpp::GenerationStats> stats)
+{
+    const gcpp::GenerationOptions options =
+        make_options(temperature, seed, regex, max_new_tokens, stop, stop_tokens,
+                     std::move(cancel), deadline_ms, config,
+                     std::move(stats));
+    PyTextStream stream_text(stream);
+    std::string text = session.Send(message, stream_text.Func(), options);
+    stream_text.Rethrow();
+    return text;
+}
+
+// Moves `values` into a 1-D NumPy array that owns them, without a copy.
+template <class T>
+py::array_t<T> to_numpy(std::vector<T> values)
+{
+    auto *owned = new std::vector<T>(std::move(values));
+    py::capsule owner(owned, [](void *pointer)
+                      { delete static_cast<std::vector<T> *>(pointer); });
+    return py::array_t<T>(owned->size(), owned->data(), owner);
+}
+
+static_assert(sizeof(int) == sizeof(int32_t), "token ids are exchanged as int32");
+
+// Any buffer-protocol object or sequence of ints; an int32 C-contiguous
+// array is read in place, anything else is converted first.
+using TokenArray = py::array_t<int32_t, py::array::c_style | py::array::forcecast>;
+
+std::vector<int> from_numpy(const TokenArray &tokens)
+{
+    if (tokens.ndim() != 1)
+    {
+        throw std::invalid_argument("Token arrays must be one-dimensional.");
+    }
+    return std::vector<int>(tokens.data(), tokens.data() + tokens.size());
+}
+
+py::array_t<int> generate_tokens_wrapper(gcpp::GemmaModel &model, const TokenArray &prompt,
+                                         const py::object &stream,
+                                         std::optional<float> temperature,
+                                         std::optional<uint32_t> seed,
+                                         std::optional<std::string> regex,
+                                         std::optional<size_t> max_new_tokens,
+                                         StopList stop, StopTokenList stop_tokens,
+                                         std::shared_ptr<gcpp::CancellationToken> cancel,
+                                         std::optional<double> deadline_ms,
+                                         std::optional<GenerationConfig> config,
+                                         std::shared_ptr<gcpp::GenerationStats> stats)
+{
+    std::vector<int> prompt_tokens = from_numpy(prompt);
+    std::vector<int> tokens;
+    {
+        py::gil_scoped_release release;
+        const gcpp::GenerationOptions options =
+            make_options(temperature, seed, regex, max_new_tokens, stop, stop_tokens,
+                         std::move(cancel), deadline_ms, config,
+                         std::move(stats));
+        PyTextStream stream_text(stream);
+        tokens = model.GenerateTokens(std::move(prompt_tokens), stream_text.Func(), options);
+        stream_text.Rethrow();
+    }
+    return to_numpy(std::move(tokens));
+}
+
+py::array_t<int> tokenize_wrapper(const gcpp::GemmaModel &model, const std::string &text,
+                                  bool add_bos)
+{
+    std::vector<std::vector<int>> tokens;
+    {
+        py::gil_scoped_release release;
+        tokens = model.Tokenize({text}, add_bos);
+    }
+    return to_numpy(std::move(tokens[0]));
+}
+
+py::list tokenize_batch_wrapper(const gcpp::GemmaModel &model,
+                                const std::vector<std::string> &texts, bool add_bos)
+{
+    std::vector<std::vector<int>> tokens;
+    {
+        py::gil_scoped_release release;
+        tokens = model.Tokenize(texts, add_bos);
+    }
+    py::list arrays;
+    for (std::vector<int> &values : tokens)
+    {
+        arrays.append(to_numpy(std::move(values)));
+    }
+    return arrays;
+}
+
+py::list detokenize_batch_wrapper(const gcpp::GemmaModel &model,
+                                  const std::vector<TokenArray> &arrays)
+{
+    std::vector<std::vector<int>> tokens;
+    tokens.reserve(arrays.size());
+    for (const TokenArray &array : arrays)
+    {
+        tokens.push_back(from_numpy(array));
+    }
+    std::vector<std::string> texts;
+    {
+        py::gil_scoped_release release;
+        texts = model.Detokenize(tokens);
+    }
+    py::list result;
+    for (const std::string &text : texts)
+    {
+        result.append(to_py_str(text));
+    }
+    return result;
+}
+
+py::str detokenize_wrapper(const gcpp::GemmaModel &model, const TokenArray &tokens)
+{
+    std::vector<std::string> texts;
+    {
+        std::vector<std::vector<int>> batch = {from_numpy(tokens)};
+        py::gil_scoped_release release;
+        texts = model.Detokenize(batch);
+    }
+    return to_py_str(texts[0]);
+}
+
+double percentile(std::vector<double> values, double fraction)
+{
+    if (values.empty())
+    {
+        return 0.0;
+    }
+    const size_t rank = static_cast<size_t>(std::ceil(fraction * values.size()));
+    const size_t index = std::min(values.size() - 1, rank == 0 ? 0 : rank - 1);
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+// Summarizes GemmaModel::Benchmark. Prefill covers the prompt up to its last
+// token, which is fed by the first decode step and so counts towards the time
+// to first token; decode rates use the gaps between sampled tokens.
+py::dict benchmark_wrapper(gcpp::GemmaModel &model, size_t prompt_length,
+                           size_t max_new_tokens, size_t runs)
+{
+    using Seconds = std::chrono::duration<double>;
+    std::vector<gcpp::GenerationTimes> times;
+    {
+        py::gil_scoped_release release;
+        times = model.Benchmark(prompt_length, max_new_tokens, runs);
+    }
+    double prefill_s = 0.0;
+    double ttft_s = 0.0;
+    double decode_s = 0.0;
+    size_t generated = 0;
+    std::vector<double> inter_token_s;
+    for (const gcpp::GenerationTimes &run : times)
+    {
+        prefill_s += Seconds(run.prefill_end - run.start).count();
+        generated += run.sampled.size();
+        if (run.sampled.empty())
+        {
+            continue;
+        }
+        ttft_s += Seconds(run.sampled.front() - run.start).count();
+        decode_s += Seconds(run.sampled.back() - run.sampled.front()).count();
+        for (size_t i = 1; i < run.sampled.size(); ++i)
+        {
+            inter_token_s.push_back(Seconds(run.sampled[i] - run.sampled[i - 1]).count());
+        }
+    }
+    double wall_s = 0.0;
+    if (!times.empty() && !times.back().sampled.empty())
+    {
+        wall_s = Seconds(times.back().sampled.back() - times.front().start).count();
+    }
+    const size_t prefilled = (prompt_length - 1) * times.size();
+    const auto rate = [](double count, double seconds)
+    { return seconds > 0.0 ? count / seconds : 0.0; };
+
+    py::dict result;
+    result["prompt_length"] = prompt_length;
+    result["max_new_tokens"] = max_new_tokens;
+    result["runs"] = runs;
+    result["num_threads"] = model.App().num_threads;
+    result["generated_tokens"] = generated;
+    result["prefill_tokens_per_s"] = rate(prefilled, prefill_s);
+    result["decode_tokens_per_s"] = rate(inter_token_s.size(), decode_s);
+    result["ttft_ms"] = times.empty() ? 0.0 : 1e3 * ttft_s / times.size();
+    result["inter_token_p50_ms"] = 1e3 * percentile(inter_token_s, 0.50);
+    result["inter_token_p99_ms"] = 1e3 * percentile(inter_token_s, 0.99);
+    result["tokens_per_s"] = rate(generated, wall_s);
+    result["wall_s"] = wall_s;
+    result["peak_rss_bytes"] = gcpp::PeakRssBytes();
+    return result;
+}
+
+py::array_t<float> score_wrapper(gcpp::GemmaModel &model, const std::string &prompt,
+                                 const std::string &continuation)
+{
+    std::vector<float> logprobs;
+    {
+        py::gil_scoped_release release;
+        logprobs = model.Score(prompt, continuation);
+    }
+    return to_numpy(std::move(logprobs));
+}
+
+py::list score_batch_wrapper(gcpp::GemmaModel &model, const std::string &prompt,
+                             const std::vector<std::string> &continuations)
+{
+    std::vector<std::vector<float>> logprobs;
+    {
+        py::gil_scoped_release release;
+        logprobs = model.ScoreBatch(prompt, continuations);
+    }
+    py::list arrays;
+    for (std::vector<float> &values : logprobs)
+    {
+        arrays.append(to_numpy(std::move(values)));
+    }
+    return arrays;
+}
+
+// Wraps a Python callable for a native thread that outlives the call which
+// registered it. The callable runs with the GIL acquired, and the last copy
+// releases its reference under the GIL too.
+gcpp::TextStreamFunc make_thread_stream(py::object callback)
+{
+    if (callback.is_none())
+    {
+        return gcpp::TextStreamFunc();
+    }
+    std::shared_ptr<py::object> holder(new py::object(std::move(callback)),
+                                       [](py::object *object)
+                                       {
+                                           py::gil_scoped_acquire acquire;
+                                           delete object;
+                                       });
+    return [holder](const std::string &text)
+    {
+        py::gil_scoped_acquire acquire;
+        py::object result = (*holder)(to_py_str(text));
+        return result.is_none() || result.cast<bool>();
+    };
+}
+
+std::string wait_result(gcpp::EngineResult &result, const py::object &timeout)
+{
+    bool done;
+    {
+        const double timeout_s = timeout.is_none() ? -1.0 : timeout.cast<double>();
+        py::gil_scoped_release release;
+        done = result.Wait(timeout_s);
+    }
+    if (!done)
+    {
+        PyErr_SetString(PyExc_TimeoutError, "request did not finish in time");
+        throw py::error_already_set();
+    }
+    return result.Text();
+}
+
+// The Python exception pybind11 would raise for `error`.
+py::object exception_object(std::exception_ptr error)
+{
+    const auto make = [](PyObject *type, const char *message)
+    { return py::reinterpret_borrow<py::object>(type)(message); };
+    try
+    {
+        std::rethrow_exception(error);
+    }
+    catch (const py::error_already_set &e)
+    {
+        return e.value();
+    }
+    catch (const std::invalid_argument &e)
+    {
+        return make(PyExc_ValueError, e.what());
+    }
+    catch (const std::length_error &e)
+    {
+        return make(PyExc_ValueError, e.what());
+    }
+    catch (const std::exception &e)
+    {
+        return make(PyExc_RuntimeError, e.what());
+    }
+    catch (...)
+    {
+        return make(PyExc_RuntimeError, "unknown error");
+    }
+}
+
+// An Engine request delivered to an asyncio event loop. The engine writes
+// the text to a StreamChannel whose descriptor is registered with
+// loop.add_reader, so the text is picked up in the loop's thread and the
+// engine's threads never take the GIL. Lives as long as the loop holds the
+// reader callback, i.e. until the request has finished. Requires the GIL.
+struct AsyncRequest
+{
+    std::shared_ptr<gcpp::StreamChannel> channel;
+    std::shared_ptr<gcpp::EngineResult> result;
+    py::object loop;
+    py::object waiter;      // unresolved future of agenerate() or __anext__, or None
+    bool streaming = false; // astream(): the waiter gets the next text, else all of it
+    std::string text;       // received, not handed out yet
+    bool closed = false;
+
+    void OnReadable()
+    {
+        if (closed)
+        {
+            return;
+        }
+        closed = channel->Read(text);
+        if (closed)
+        {
+            loop.attr("remove_reader")(channel->Fd());
+        }
+        Resolve();
+    }
+
+    void Resolve()
+    {
+        if (waiter.is_none())
+        {
+            return;
+        }
+        if (waiter.attr("done")().cast<bool>())
+        {
+            waiter = py::none(); // cancelled
+            return;
+        }
+        if (streaming && !text.empty())
+        {
+            py::object future = std::move(waiter);
+            waiter = py::none();
+            future.attr("set_result")(to_py_str(text));
+            text.clear();
+            return;
+        }
+        if (!closed)
+        {
+            return;
+        }
+        py::object future = std::move(waiter);
+        waiter = py::none();
+        std::string final_text;
+        std::exception_ptr error;
+        try
+        {
+            final_text = result->Text();
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        if (error)
+        {
+            future.attr("set_exception")(exception_object(error));
+        }
+        else if (streaming)
+        {
+            future.attr("set_exception")(py::reinterpret_borrow<py::object>(PyExc_StopAsyncIteration)());
+        }
+        else
+        {
+            future.attr("set_result")(to_py_str(final_text));
+        }
+    }
+
+    // A future for the waiter; cancelling it cancels the request.
+    py::object NewWaiter()
+    {
+        waiter = loop.attr("create_future")();
+        std::shared_ptr<gcpp::EngineResult> cancel_on = result;
+        waiter.attr("add_done_callback")(py::cpp_function([cancel_on](py::object future)
+                                                          {
+            if (future.attr("cancelled")().cast<bool>())
+            {
+                cancel_on->Cancel();
+            } }));
+        return waiter;
+    }
+};
+
+std::shared_ptr<AsyncRequest> submit_async(gcpp::GemmaEngine &engine, const std::string &prompt,
+                                           int priority, const gcpp::GenerationOptions &options,
+                                           bool streaming)
+{
+    auto request = std::make_shared<AsyncRequest>();
+    request->loop = py::module_::import("asyncio").attr("get_running_loop")();
+    request->streaming = streaming;
+    request->waiter = py::none();
+    request->channel = std::make_shared<gcpp::StreamChannel>();
+    std::shared_ptr<gcpp::StreamChannel> channel = request->channel;
+    gcpp::TextStreamFunc stream_text;
+    if (streaming)
+    {
+        stream_text = [channel](const std::string &text)
+        {
+            channel->Push(text);
+            return true;
+        };
+    }
+    {
+        py::gil_scoped_release release;
+        request->result = engine.Submit(prompt, priority, std::move(stream_text), options,
+                                        [channel]
+                                        { channel->Close(); });
+    }
+    // Holds `request` until OnReadable() removes it on the last wakeup,
+    // which may release the callback while it runs.
+    request->loop.attr("add_reader")(channel->Fd(), py::cpp_function([request]
+                                                                      {
+        const std::shared_ptr<AsyncRequest> keep = request;
+        keep->OnReadable(); }));
+    return request;
+}
+
+// Async iterator over the text of one Engine request; dropping it cancels
+// the request.
+class AsyncStream
+{
+public:
+    explicit AsyncStream(std::shared_ptr<AsyncRequest> request) : request_(std::move(request)) {}
+    ~AsyncStream() { request_->result->Cancel(); }
+
+    py::object Next()
+    {
+        if (!request_->waiter.is_none())
+        {
+            throw std::runtime_error("__anext__() is already being awaited");
+        }
+        py::object future = request_->NewWaiter();
+        request_->Resolve();
+        return future;
+    }
+
+    void Cancel() { request_->result->Cancel(); }
+
+private:
+    std::shared_ptr<AsyncRequest> request_;
+};
+
+// The engine's stream thread may be waiting for the GIL to run a stream
+// callback, so the engine is joined with the GIL released.
+struct EngineDeleter
+{
+    void operator()(gcpp::GemmaEngine *engine) const
+    {
+        py::gil_scoped_release release;
+        delete engine;
+    }
+};
+
+std::shared_ptr<gcpp::GemmaModel> make_model(std::vector<std::string> args,
+                                             std::optional<size_t> num_threads,
+                                             std::optional<size_t> prefill_chunk,
+                                             bool share_weights)
+{
+    if (num_threads)
+    {
+        args.push_back("--num_threads");
+        args.push_back(std::to_string(*num_threads));
+    }
+    if (prefill_chunk)
+    {
+        args.push_back("--prefill_chunk");
+        args.push_back(std::to_string(*prefill_chunk));
+    }
+    std::vector<char *> argv_vec = make_argv(args);
+    int argc = argv_vec.size();
+    char **argv = argv_vec.data();
+    gcpp::LoaderArgs loader(argc, argv);
+    gcpp::InferenceArgs inference(argc, argv);
+    gcpp::AppArgs app(argc, argv);
+    gcpp::ThreadingArgs threading(argc, argv);
+    gcpp::PrefetchArgs prefetch(argc, argv);
+    gcpp::ServingArgs serving(argc, argv);
+    gcpp::DefaultNumThreads(argc, argv, app, threading);
+    // Only the load runs without the GIL: pybind11 registers the new
+    // instance in its shared internals once this returns.
+    py::gil_scoped_release release;
+    return std::make_shared<gcpp::GemmaModel>(loader, inference, app, threading,
+                                               prefetch, serving, share_weights);
+}
+
+std::unique_ptr<gcpp::GemmaSession> make_session(std::shared_ptr<gcpp::GemmaModel> model,
+                                                 std::string system_prompt, bool sliding_window)
+{
+    py::gil_scoped_release release; // tokenizes the system prompt
+    return std::make_unique<gcpp::GemmaSession>(std::move(model), std::move(system_prompt),
+                                                sliding_window);
+}
+void show_help_wrapper()
+{
+    // Assuming ShowHelp does not critically depend on argv content
+    gcpp::LoaderArgs loader(0, nullptr);
+    gcpp::InferenceArgs inference(0, nullptr);
+    gcpp::AppArgs app(0, nullptr);
+
+    ShowHelp(loader, inference, app);
+}
+
+std::string chat_base_wrapper(const std::vector<std::string> &args)
+{
+    std::vector<char *> argv_vec = make_argv(args);
+    int argc = argv_vec.size();
+    char **argv = argv_vec.data();
+
+    chat_base(argc, argv);
+    return std::string();
+}
+
+PYBIND11_MODULE(pygemma, m)
+{
+    m.doc() = "Pybind11 integration for chat_base function";
+    m.def("chat_base", &chat_base_wrapper, "A wrapper for the chat_base function accepting Python list of strings as arguments",
+          py::call_guard<py::gil_scoped_release>());
+    m.def("show_help", &show_help_wrapper, "A wrapper for show_help function");
+    m.attr("top_k") = gcpp::kTopK; // compiled into gemma.cpp, see GEMMA_TOPK
+    m.def("detach_threads", &gcpp::DetachModels,
+          "Waits for running generations and stops the worker threads of all loaded models "
+          "before os.fork(), so the weights are shared copy-on-write with the children. "
+          "Loading and generation wait until reattach_threads()",
+          py::call_guard<py::gil_scoped_release>());
+    m.def("reattach_threads", &gcpp::ReattachModels,
+          "Starts and pins new worker threads after detach_threads(), in the parent or the "
+          "forked child",
+          py::call_guard<py::gil_scoped_release>());
+    // Pre-fork servers load the model once and fork workers; without this
+    // the children would inherit pools whose threads do not exist.
+    py::module_ os = py::module_::import("os");
+    if (py::hasattr(os, "register_at_fork"))
+    {
+        os.attr("register_at_fork")(py::arg("before") = m.attr("detach_threads"),
+                                    py::arg("after_in_parent") = m.attr("reattach_threads"),
+                                    py::arg("after_in_child") = m.attr("reattach_threads"));
+    }
+    m.def("completion", &completion_base_wrapper, "A wrapper for inference function",
+          py::call_guard<py::gil_scoped_release>());
+
+    py::class_<GenerationConfig>(m, "GenerationConfig",
+                                 "Sampling and stop settings that are validated once and can be "
+                                 "passed as config= to any generation call. Fields left as None "
+                                 "keep the model's loaded settings; keyword arguments given "
+                                 "with a config override it for that call. temperature and "
+                                 "seed need a build with pygemma.top_k > 1")
+        .def(py::init(&make_config), py::arg("temperature") = py::none(),
+             py::arg("seed") = py::none(), py::arg("regex") = py::none(),
+             py::arg("max_new_tokens") = py::none(), py::arg("stop") = py::none(),
+             py::arg("stop_tokens") = py::none(), py::arg("deadline_ms") = py::none())
+        .def(py::init<const GenerationConfig &>(), py::arg("other"), "Copies a config")
+        .def_property(
+            "temperature", [](const GenerationConfig &config)
+            { return config.options.temperature; },
+            [](GenerationConfig &config, std::optional<float> value)
+            { update_config(config, [&](GenerationConfig &c)
+                            { c.options.temperature = value; }); })
+        .def_property(
+            "seed", [](const GenerationConfig &config)
+            { return config.options.seed; },
+            [](GenerationConfig &config, std::optional<uint32_t> value)
+            { update_config(config, [&](GenerationConfig &c)
+                            { c.options.seed = value; }); })
+        .def_property(
+            "regex", [](const GenerationConfig &config)
+            { return config.options.regex.empty() ? std::optional<std::string>()
+                                                  : config.options.regex; },
+            [](GenerationConfig &config, std::optional<std::string> value)
+            { update_config(config, [&](GenerationConfig &c)
+                            { c.options.regex = value.value_or(std::string()); }); })
+        .def_property(
+            "max_new_tokens", [](const GenerationConfig &config)
+            { return config.options.max_new_tokens; },
+            [](GenerationConfig &config, std::optional<size_t> value)
+            { update_config(config, [&](GenerationConfig &c)
+                            { c.options.max_new_tokens = value; }); })
+        .def_property(
+            "stop", [](const GenerationConfig &config)
+            { return config.options.stop; },
+            [](GenerationConfig &config, StopList value)
+            { update_config(config, [&](GenerationConfig &c)
+                            { c.options.stop = value.value_or(std::vector<std::string>()); }); })
+        .def_property(
+            "stop_tokens", [](const GenerationConfig &config)
+            { return config.options.stop_tokens; },
+            [](GenerationConfig &config, StopTokenList value)
+            { update_config(config, [&](GenerationConfig &c)
+                            { c.options.stop_tokens =
+                                  value.value_or(std::vector<std::vector<int>>()); }); })
+        .def_property(
+            "deadline_ms", [](const GenerationConfig &config)
+            { return config.deadline_ms; },
+            [](GenerationConfig &config, std::optional<double> value)
+            { update_config(config, [&](GenerationConfig &c)
+                            { c.deadline_ms = value; }); });
+
+    py::class_<gcpp::GenerationStats, std::shared_ptr<gcpp::GenerationStats>>(
+        m, "GenerationStats",
+        "Pass as stats= to generation calls; each finished request adds its token counts "
+        "and timings in seconds")
+        .def(py::init<>())
+        .def_readonly("requests", &gcpp::GenerationStats::requests)
+        .def_readonly("prompt_tokens", &gcpp::GenerationStats::prompt_tokens)
+        .def_readonly("cached_tokens", &gcpp::GenerationStats::cached_tokens,
+                      "Prompt tokens whose KV state was reused instead of prefilled")
+        .def_readonly("generated_tokens", &gcpp::GenerationStats::generated_tokens)
+        .def_readonly("tokenize_s", &gcpp::GenerationStats::tokenize_s)
+        .def_readonly("prefill_s", &gcpp::GenerationStats::prefill_s)
+        .def_readonly("decode_s", &gcpp::GenerationStats::decode_s,
+                      "From the end of the prefill to the last sampled token, including "
+                      "sampling, detokenization and the stream callback")
+        .def_readonly("detokenize_s", &gcpp::GenerationStats::detokenize_s)
+        .def_property_readonly(
+            "token_s", [](const gcpp::GenerationStats &stats)
+            { return to_numpy(std::vector<double>(stats.token_s)); },
+            "Duration of each decode step as a float64 array; the first one ends with the "
+            "first sampled token");
+
+    m.def("metrics", []()
+          {
+              const gcpp::Metrics &metrics = gcpp::GlobalMetrics();
+              py::dict result;
+              result["models_loaded"] = metrics.models.load();
+              result["weights_loaded"] = metrics.weights.load();
+              result["requests"] = metrics.requests.load();
+              result["requests_cancelled"] = metrics.cancelled.load();
+              result["requests_failed"] = metrics.failed.load();
+              result["cached_tokens"] = metrics.cached_tokens.load();
+              result["prefill_tokens"] = metrics.prefill_tokens.load();
+              result["generated_tokens"] = metrics.generated_tokens.load();
+              result["load_s"] = metrics.load_ns.load() * 1e-9;
+              result["prefill_s"] = metrics.prefill_ns.load() * 1e-9;
+              result["decode_s"] = metrics.decode_ns.load() * 1e-9;
+              return result; },
+          "Process-wide counters over all models since the module was loaded");
+    m.def("metrics_text", &gcpp::MetricsText,
+          "The counters of metrics() in the Prometheus text exposition format");
+    m.def("print_profiler_results", []()
+          { PROFILER_PRINT_RESULTS(); },
+          "Prints the hwy profiler zones to stderr; empty unless built with "
+          "PROFILER_ENABLED=1");
+
+    // All model entry points release the GIL: loading and generation run
+    // without blocking other Python threads, and GemmaModel serializes
+    // concurrent callers itself.
+    py::class_<gcpp::GemmaModel, std::shared_ptr<gcpp::GemmaModel>>(m, "Gemma",
+                                 "A loaded model that keeps its weights and thread pools between calls. "
+                                 "Safe to share between threads; generation calls on one model run one at a time.")
+        .def(py::init(&make_model), py::arg("args"), py::arg("num_threads") = py::none(),
+             py::arg("prefill_chunk") = py::none(), py::arg("share_weights") = true,
+             "Loads the model once from gemma.cpp style arguments, e.g. "
+             "['--tokenizer', ..., '--compressed_weights', ..., '--model', ...]. "
+             "num_threads sizes the thread pool; by default it has one thread per "
+             "physical core of the CPUs it may use. prefill_chunk splits the prefill "
+             "of long prompts into calls of that many tokens. With share_weights, a "
+             "model with the same weights, tokenizer and threads that is already "
+             "loaded is reused: only the other settings, such as temperature, are this "
+             "object's own")
+        .def("generate", &generate_wrapper, py::arg("prompt"), py::arg("stream") = py::none(),
+             py::arg("temperature") = py::none(), py::arg("seed") = py::none(),
+             py::arg("regex") = py::none(), py::arg("max_new_tokens") = py::none(),
+             py::arg("stop") = py::none(), py::arg("stop_tokens") = py::none(),
+             py::arg("cancel") = py::none(), py::arg("deadline_ms") = py::none(),
+             py::arg("config") = py::none(), py::arg("stats") = py::none(),
+             "Generates a completion for the prompt using the loaded model. If stream is "
+             "given, it is called with each new piece of text as it is generated and may "
+             "return False to stop early. temperature and seed override the loaded "
+             "settings for this request; they need a build with pygemma.top_k > 1 and "
+             "raise ValueError under greedy decoding. regex restricts the output to text the whole "
+             "pattern matches. Generation ends after max_new_tokens tokens, before any of "
+             "the stop strings (which are not returned), or after any of the stop_tokens "
+             "token sequences. It also ends, returning the text so far, once the "
+             "CancellationToken given as cancel is cancelled or deadline_ms milliseconds "
+             "have passed. config is a GenerationConfig with defaults for these settings, "
+             "and a GenerationStats given as stats receives the request's timings",
+             py::call_guard<py::gil_scoped_release>())
+        .def("completion", &generate_wrapper, py::arg("prompt"), py::arg("stream") = py::none(),
+             py::arg("temperature") = py::none(), py::arg("seed") = py::none(),
+             py::arg("regex") = py::none(), py::arg("max_new_tokens") = py::none(),
+             py::arg("stop") = py::none(), py::arg("stop_tokens") = py::none(),
+             py::arg("cancel") = py::none(), py::arg("deadline_ms") = py::none(),
+             py::arg("config") = py::none(), py::arg("stats") = py::none(),
+             "Alias of generate(), matching pygemma.completion",
+             py::call_guard<py::gil_scoped_release>())
+        .def("generate_batch", &generate_batch_wrapper, py::arg("prompts"),
+             py::arg("stream") = py::none(), py::arg("temperature") = py::none(),
+             py::arg("seed") = py::none(),
+             py::arg("regex") = py::none(), py::arg("max_new_tokens") = py::none(),
+             py::arg("stop") = py::none(), py::arg("stop_tokens") = py::none(),
+             py::arg("cancel") = py::none(), py::arg("deadline_ms") = py::none(),
+             py::arg("config") = py::none(), py::arg("stats") = py::none(),
+             "Generates completions for a list of prompts and returns them in the same order. "
+             "Prompts with a common prefix share its prefill. If stream is given, it is "
+             "called with (index, text) for each new piece of text",
+             py::call_guard<py::gil_scoped_release>())
+        .def("generate_tokens", &generate_tokens_wrapper, py::arg("prompt_tokens"),
+             py::arg("stream") = py::none(), py::arg("temperature") = py::none(),
+             py::arg("seed") = py::none(),
+             py::arg("regex") = py::none(), py::arg("max_new_tokens") = py::none(),
+             py::arg("stop") = py::none(), py::arg("stop_tokens") = py::none(),
+             py::arg("cancel") = py::none(), py::arg("deadline_ms") = py::none(),
+             py::arg("config") = py::none(), py::arg("stats") = py::none(),
+             "Like generate(), but takes the prompt as token ids (an int32 NumPy array or "
+             "any buffer or sequence of ints) and returns the generated token ids, without "
+             "EOS, as an int32 array. The prompt is used as is, so it must start with <bos> "
+             "and contain any turn control tokens")
+        .def("tokenize", &tokenize_wrapper, py::arg("text"), py::arg("add_bos") = false,
+             "Returns the token ids of the text as an int32 NumPy array")
+        .def("tokenize_batch", &tokenize_batch_wrapper, py::arg("texts"),
+             py::arg("add_bos") = false,
+             "Tokenizes a list of texts without holding the GIL; returns a list of arrays")
+        .def("detokenize", &detokenize_wrapper, py::arg("tokens"),
+             "Returns the text of an int32 array (or buffer or sequence) of token ids")
+        .def("detokenize_batch", &detokenize_batch_wrapper, py::arg("tokens"),
+             "Detokenizes a list of token id arrays without holding the GIL; returns a list "
+             "of strings")
+        .def("benchmark", &benchmark_wrapper, py::arg("prompt_length") = 128,
+             py::arg("max_new_tokens") = 128, py::arg("runs") = 1,
+             "Times `runs` sequential generations of max_new_tokens tokens after a synthetic "
+             "prompt of prompt_length tokens and returns a dict with prefill and decode "
+             "tokens/s, time to first token, p50/p99 inter-token latency and peak RSS. "
+             "Drops the KV cache; see scripts/benchmark.py for sweeps")
+        .def("score", &score_wrapper, py::arg("prompt"), py::arg("continuation"),
+             "Returns a float32 NumPy array with the log-probability of each token of the "
+             "continuation following the prompt. Nothing is sampled; the continuation is fed "
+             "one forced token per step")
+        .def("score_batch", &score_batch_wrapper, py::arg("prompt"), py::arg("continuations"),
+             "Scores several continuations of one prompt, which is prefilled only once; "
+             "returns a list of arrays as score() does")
+        .def("cache_prefix", &gcpp::GemmaModel::CachePrefix, py::arg("prefix"),
+             "Prefills the KV cache with the start of future prompts (e.g. a shared system "
+             "prompt) so requests beginning with it skip that part of the prefill. "
+             "Returns the number of cached tokens",
+             py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("load_seconds", &gcpp::GemmaModel::LoadSeconds,
+                               "Time taken to prefetch and load the weights, or to find them "
+                               "already loaded")
+        .def_property_readonly("weight_users", &gcpp::GemmaModel::WeightUsers,
+                               "Number of Gemma objects sharing this model's weights, this one "
+                               "included")
+        .def_property_readonly(
+            "cached_tokens", [](gcpp::GemmaModel &model)
+            {
+                py::gil_scoped_release release;
+                return model.CachedTokens(); },
+            "Number of tokens whose KV state is currently cached")
+        .def_property_readonly(
+            "prefill_chunk", [](const gcpp::GemmaModel &model)
+            { return model.Serving().PrefillChunk(); },
+            "Tokens prefilled per call, a multiple of the compiled prefill batch size; 0 if "
+            "prompts are prefilled in one call")
+        .def_property_readonly("kv_bytes_per_token", &gcpp::GemmaModel::KVCacheBytesPerToken,
+                               "Bytes of float32 KV cache state per token of context");
+
+    py::class_<gcpp::CancellationToken, std::shared_ptr<gcpp::CancellationToken>>(
+        m, "CancellationToken",
+        "Pass as cancel= to a generation call; cancel() from any thread ends it with the text "
+        "generated so far")
+        .def(py::init<>())
+        .def("cancel", &gcpp::CancellationToken::Cancel)
+        .def_property_readonly("cancelled", &gcpp::CancellationToken::Cancelled);
+
+    py::class_<gcpp::GemmaSession>(m, "Session",
+                                   "A multi-turn chat on a loaded Gemma that reuses the KV cache of earlier turns")
+        .def(py::init(&make_session), py::arg("model"),
+             py::arg("system_prompt") = std::string(), py::arg("sliding_window") = false,
+             "system_prompt starts the first user turn and is kept for the whole "
+             "conversation. With sliding_window, turns that would exceed --max_tokens "
+             "evict the oldest turns after it instead of raising")
+        .def("send", &send_wrapper, py::arg("message"), py::arg("stream") = py::none(),
+             py::arg("temperature") = py::none(), py::arg("seed") = py::none(),
+             py::arg("regex") = py::none(), py::arg("max_new_tokens") = py::none(),
+             py::arg("stop") = py::none(), py::arg("stop_tokens") = py::none(),
+             py::arg("cancel") = py::none(), py::arg("deadline_ms") = py::none(),
+             py::arg("config") = py::none(), py::arg("stats") = py::none(),
+             "Sends a user turn and returns the reply; the keyword arguments work as in "
+             "Gemma.generate()",
+             py::call_guard<py::gil_scoped_release>())
+        .def("reset", &gcpp::GemmaSession::Reset, "Starts a new conversation",
+             py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly(
+            "position", [](gcpp::GemmaSession &session)
+            {
+                py::gil_scoped_release release;
+                return session.Position(); },
+            "Number of tokens in the conversation so far")
+        .def_property_readonly(
+            "evicted_tokens", [](gcpp::GemmaSession &session)
+            {
+                py::gil_scoped_release release;
+                return session.EvictedTokens(); },
+            "Number of tokens the sliding window has dropped since the last reset()");
+
+    py::class_<gcpp::EngineResult, std::shared_ptr<gcpp::EngineResult>>(m, "Request",
+                                                                        "A request submitted to an Engine")
+        .def("done", &gcpp::EngineResult::Done, "Whether the request has finished")
+        .def("cancel", &gcpp::EngineResult::Cancel,
+             "Cancels the request, whether queued or running; result() then returns the text "
+             "generated so far")
+        .def("result", &wait_result, py::arg("timeout") = py::none(),
+             "Waits for the request and returns its text; raises TimeoutError if it is "
+             "still running after timeout seconds, or the error the request failed with");
+
+    py::class_<AsyncStream>(m, "AsyncStream", "The async iterator returned by Engine.astream()")
+        .def("__aiter__", [](py::object self)
+             { return self; })
+        .def("__anext__", &AsyncStream::Next)
+        .def("cancel", &AsyncStream::Cancel, "Cancels the request");
+
+    py::class_<gcpp::GemmaEngine, std::unique_ptr<gcpp::GemmaEngine, EngineDeleter>>(
+        m, "Engine",
+        "Serves requests from many threads on one Gemma through a native engine thread, "
+        "highest priority first")
+        .def(py::init<std::shared_ptr<gcpp::GemmaModel>, size_t, size_t>(), py::arg("model"),
+             py::arg("max_queue_depth") = 64, py::arg("time_slice") = 0,
+             "max_queue_depth bounds the waiting requests; submitting beyond it raises. With "
+             "time_slice > 0, the running request yields every time_slice tokens to waiting "
+             "requests of at least its priority")
+        .def(
+            "submit", [](gcpp::GemmaEngine &engine, std::string prompt, int priority, py::object stream,
+                         std::optional<float> temperature, std::optional<uint32_t> seed,
+                         std::optional<std::string> regex,
+                         std::optional<size_t> max_new_tokens, StopList stop,
+                         StopTokenList stop_tokens,
+                         std::shared_ptr<gcpp::CancellationToken> cancel,
+                         std::optional<double> deadline_ms,
+                         std::optional<GenerationConfig> config,
+                         std::shared_ptr<gcpp::GenerationStats> stats)
+            {
+                const gcpp::GenerationOptions options =
+                    make_options(temperature, seed, regex, max_new_tokens, stop, stop_tokens,
+                                 std::move(cancel), deadline_ms, config,
+                                 std::move(stats));
+                gcpp::TextStreamFunc stream_text = make_thread_stream(std::move(stream));
+                py::gil_scoped_release release; // tokenizes, and compiles regex=
+                return engine.Submit(prompt, priority, std::move(stream_text), options); },
+            py::arg("prompt"), py::arg("priority") = 0, py::arg("stream") = py::none(),
+            py::arg("temperature") = py::none(), py::arg("seed") = py::none(),
+            py::arg("regex") = py::none(), py::arg("max_new_tokens") = py::none(),
+            py::arg("stop") = py::none(), py::arg("stop_tokens") = py::none(),
+            py::arg("cancel") = py::none(), py::arg("deadline_ms") = py::none(),
+            py::arg("config") = py::none(), py::arg("stats") = py::none(),
+            "Queues a prompt and returns a Request. stream is called from a thread of the "
+            "engine that only runs stream callbacks")
+        .def(
+            "generate", [](gcpp::GemmaEngine &engine, std::string prompt, int priority, py::object stream,
+                           std::optional<float> temperature, std::optional<uint32_t> seed,
+                           std::optional<std::string> regex,
+                           std::optional<size_t> max_new_tokens, StopList stop,
+                           StopTokenList stop_tokens,
+                           std::shared_ptr<gcpp::CancellationToken> cancel,
+                           std::optional<double> deadline_ms,
+                           std::optional<GenerationConfig> config,
+                           std::shared_ptr<gcpp::GenerationStats> stats)
+            {
+                const gcpp::GenerationOptions options =
+                    make_options(temperature, seed, regex, max_new_tokens, stop, stop_tokens,
+                                 std::move(cancel), deadline_ms, config,
+                                 std::move(stats));
+                gcpp::TextStreamFunc stream_text = make_thread_stream(std::move(stream));
+                std::shared_ptr<gcpp::EngineResult> result;
+                {
+                    py::gil_scoped_release release; // tokenizes, and compiles regex=
+                    result = engine.Submit(prompt, priority, std::move(stream_text), options);
+                }
+                return wait_result(*result, py::none()); },
+            py::arg("prompt"), py::arg("priority") = 0, py::arg("stream") = py::none(),
+            py::arg("temperature") = py::none(), py::arg("seed") = py::none(),
+            py::arg("regex") = py::none(), py::arg("max_new_tokens") = py::none(),
+            py::arg("stop") = py::none(), py::arg("stop_tokens") = py::none(),
+            py::arg("cancel") = py::none(), py::arg("deadline_ms") = py::none(),
+            py::arg("config") = py::none(), py::arg("stats") = py::none(),
+            "Submits a prompt and waits for its completion")
+        .def(
+            "agenerate", [](gcpp::GemmaEngine &engine, std::string prompt, int priority,
+                            std::optional<float> temperature, std::optional<uint32_t> seed,
+                            std::optional<std::string> regex,
+                            std::optional<size_t> max_new_tokens, StopList stop,
+                            StopTokenList stop_tokens,
+                            std::shared_ptr<gcpp::CancellationToken> cancel,
+                            std::optional<double> deadline_ms,
+                            std::optional<GenerationConfig> config,
+                            std::shared_ptr<gcpp::GenerationStats> stats)
+            {
+                const gcpp::GenerationOptions options =
+                    make_options(temperature, seed, regex, max_new_tokens, stop, stop_tokens,
+                                 std::move(cancel), deadline_ms, config, std::move(stats));
+                std::shared_ptr<AsyncRequest> request =
+                    submit_async(engine, prompt, priority, options, /*streaming=*/false);
+                py::object future = request->NewWaiter();
+                request->Resolve();
+                return future; },
+            py::arg("prompt"), py::arg("priority") = 0,
+            py::arg("temperature") = py::none(), py::arg("seed") = py::none(),
+            py::arg("regex") = py::none(), py::arg("max_new_tokens") = py::none(),
+            py::arg("stop") = py::none(), py::arg("stop_tokens") = py::none(),
+            py::arg("cancel") = py::none(), py::arg("deadline_ms") = py::none(),
+            py::arg("config") = py::none(), py::arg("stats") = py::none(),
+            "Queues a prompt and returns an asyncio future for its completion. Must be "
+            "called from the thread running the event loop; cancelling the future cancels "
+            "the request")
+        .def(
+            "astream", [](gcpp::GemmaEngine &engine, std::string prompt, int priority,
+                          std::optional<float> temperature, std::optional<uint32_t> seed,
+                          std::optional<std::string> regex,
+                          std::optional<size_t> max_new_tokens, StopList stop,
+                          StopTokenList stop_tokens,
+                          std::shared_ptr<gcpp::CancellationToken> cancel,
+                          std::optional<double> deadline_ms,
+                          std::optional<GenerationConfig> config,
+                          std::shared_ptr<gcpp::GenerationStats> stats)
+            {
+                const gcpp::GenerationOptions options =
+                    make_options(temperature, seed, regex, max_new_tokens, stop, stop_tokens,
+                                 std::move(cancel), deadline_ms, config, std::move(stats));
+                return std::make_unique<AsyncStream>(
+                    submit_async(engine, prompt, priority, options, /*streaming=*/true)); },
+            py::arg("prompt"), py::arg("priority") = 0,
+            py::arg("temperature") = py::none(), py::arg("seed") = py::none(),
+            py::arg("regex") = py::none(), py::arg("max_new_tokens") = py::none(),
+            py::arg("stop") = py::none(), py::arg("stop_tokens") = py::none(),
+            py::arg("cancel") = py::none(), py::arg("deadline_ms") = py::none(),
+            py::arg("config") = py::none(), py::arg("stats") = py::none(),
+            "Queues a prompt and returns an async iterator over its text, for use with "
+            "async for in the thread running the event loop. Text that arrives while the "
+            "consumer is busy is joined into one piece")
+        .def_property_readonly("queue_depth", &gcpp::GemmaEngine::QueueDepth,
+                               "Number of requests waiting to run")
+        .def("close", &gcpp::GemmaEngine::Stop,
+             "Stops the engine; unfinished requests fail",
+             py::call_guard<py::gil_scoped_release>());
 }
@@ -0,0 +1,91 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <atomic>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GEMMA_CPP_PYTHON_HAVE_MMAP 1
+#else
+#define GEMMA_CPP_PYTHON_HAVE_MMAP 0
+#endif
+
+namespace gcpp
+{
+
+    std::unique_ptr<MappedFile> MappedFile::Open(const std::string &path)
+    {
+#if GEMMA_CPP_PYTHON_HAVE_MMAP
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            close(fd);
+            return nullptr;
+        }
+        const size_t size = static_cast<size_t>(info.st_size);
+        void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd); // the mapping keeps the file open
+        if (data == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        madvise(data, size, MADV_WILLNEED);
+        return std::unique_ptr<MappedFile>(new MappedFile(data, size));
+#else
+        (void)path;
+        return nullptr;
+#endif
+    }
+
+    MappedFile::~MappedFile()
+    {
+#if GEMMA_CPP_PYTHON_HAVE_MMAP
+        if (locked_)
+        {
+            munlock(data_, size_);
+        }
+        munmap(data_, size_);
+#endif
+    }
+
+    void MappedFile::Populate(hwy::ThreadPool &pool)
+    {
+#if GEMMA_CPP_PYTHON_HAVE_MMAP
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        constexpr size_t kChunk = size_t{4} << 20; // per task
+        const size_t num_chunks = (size_ + kChunk - 1) / kChunk;
+        const volatile unsigned char *bytes = static_cast<const unsigned char *>(data_);
+        std::atomic<unsigned> sink{0};
+        pool.Run(0, num_chunks, [&](uint64_t chunk, size_t /*thread*/)
+                 {
+                     const size_t end = std::min(size_, (chunk + 1) * kChunk);
+                     unsigned sum = 0;
+                     for (size_t offset = chunk * kChunk; offset < end; offset += page)
+                     {
+                         sum += bytes[offset]; // one read faults in the page
+                     }
+                     sink.fetch_add(sum, std::memory_order_relaxed); });
+#else
+        (void)pool;
+#endif
+    }
+
+    bool MappedFile::Lock()
+    {
+#if GEMMA_CPP_PYTHON_HAVE_MMAP
+        locked_ = locked_ || mlock(data_, size_) == 0;
+        return locked_;
+#else
+        return false;
+#endif
+    }
+
+} // namespace gcpp
@@ -0,0 +1,77 @@
+#ifndef GEMMA_CPP_PYTHON_MAPPED_FILE_H_
+#define GEMMA_CPP_PYTHON_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include "util/args.h"
+#include "hwy/contrib/thread_pool/thread_pool.h"
+
+namespace gcpp
+{
+
+    // Flags for keeping the weights file in the page cache.
+    class PrefetchArgs : public ArgsBase<PrefetchArgs>
+    {
+    public:
+        PrefetchArgs(int argc, char *argv[]) { InitAndParse(argc, argv); }
+
+        // Returns error string or nullptr if OK.
+        const char *Validate() const
+        {
+            if (prefetch_weights != "none" && prefetch_weights != "populate" &&
+                prefetch_weights != "lock")
+            {
+                return "--prefetch_weights must be one of none, populate or lock.";
+            }
+            return nullptr;
+        }
+
+        std::string prefetch_weights;
+
+        template <class Visitor>
+        void ForEach(const Visitor &visitor)
+        {
+            visitor(prefetch_weights, "prefetch_weights", std::string("none"),
+                    "Map the weights file read-only before loading: none, populate or lock.\n"
+                    "    populate reads it into the page cache with all pool threads;\n"
+                    "    lock also keeps it resident while the model is loaded.",
+                    2);
+        }
+    };
+
+    // A read-only, shared mapping of a whole file. The pages belong to the
+    // page cache, so every process mapping the same file shares them.
+    class MappedFile
+    {
+    public:
+        // Returns nullptr if the file cannot be mapped on this platform.
+        static std::unique_ptr<MappedFile> Open(const std::string &path);
+
+        ~MappedFile();
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        // Faults in every page, reading the file with all threads of `pool`
+        // so that the device sees many requests at once.
+        void Populate(hwy::ThreadPool &pool);
+
+        // Keeps the pages resident until destruction. Returns false if the
+        // memory lock limit does not allow it.
+        bool Lock();
+
+        size_t Size() const { return size_; }
+
+    private:
+        MappedFile(void *data, size_t size) : data_(data), size_(size) {}
+
+        void *data_;
+        size_t size_;
+        bool locked_ = false;
+    };
+
+} // namespace gcpp
+
+#endif // GEMMA_CPP_PYTHON_MAPPED_FILE_H_
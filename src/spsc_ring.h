@@ -0,0 +1,69 @@
+#ifndef GEMMA_CPP_PYTHON_SPSC_RING_H_
+#define GEMMA_CPP_PYTHON_SPSC_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace gcpp
+{
+
+    // Wait-free queue between exactly one producer thread and one consumer
+    // thread. Holds up to `capacity` elements, rounded up to a power of two.
+    // Slots are reused, so strings and vectors keep their capacity.
+    template <class T>
+    class SpscRing
+    {
+    public:
+        explicit SpscRing(size_t capacity)
+        {
+            size_t size = 1;
+            while (size < capacity)
+            {
+                size *= 2;
+            }
+            slots_.resize(size);
+            mask_ = size - 1;
+        }
+
+        SpscRing(const SpscRing &) = delete;
+        SpscRing &operator=(const SpscRing &) = delete;
+
+        // Producer only. Moves from `value` and returns true unless the ring
+        // is full, in which case `value` is left untouched.
+        bool TryPush(T &&value)
+        {
+            const size_t tail = tail_.load(std::memory_order_relaxed);
+            if (tail - head_.load(std::memory_order_acquire) > mask_)
+            {
+                return false;
+            }
+            slots_[tail & mask_] = std::move(value);
+            tail_.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer only. Returns false if the ring is empty.
+        bool TryPop(T &value)
+        {
+            const size_t head = head_.load(std::memory_order_relaxed);
+            if (head == tail_.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            std::swap(value, slots_[head & mask_]);
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        std::vector<T> slots_;
+        size_t mask_;
+        alignas(64) std::atomic<size_t> head_{0}; // next slot to pop, written by the consumer
+        alignas(64) std::atomic<size_t> tail_{0}; // next slot to push, written by the producer
+    };
+
+} // namespace gcpp
+
+#endif // GEMMA_CPP_PYTHON_SPSC_RING_H_
@@ -0,0 +1,117 @@
+#include "stream_channel.h"
+
+#include <cstdint>
+#include <stdexcept>
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <unistd.h>
+#define GEMMA_CPP_PYTHON_HAVE_EVENTFD 1
+#define GEMMA_CPP_PYTHON_HAVE_PIPE 0
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#define GEMMA_CPP_PYTHON_HAVE_EVENTFD 0
+#define GEMMA_CPP_PYTHON_HAVE_PIPE 1
+#else
+#define GEMMA_CPP_PYTHON_HAVE_EVENTFD 0
+#define GEMMA_CPP_PYTHON_HAVE_PIPE 0
+#endif
+
+namespace gcpp
+{
+
+    StreamChannel::StreamChannel(size_t capacity) : ring_(capacity)
+    {
+#if GEMMA_CPP_PYTHON_HAVE_EVENTFD
+        read_fd_ = write_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif GEMMA_CPP_PYTHON_HAVE_PIPE
+        int fds[2];
+        if (pipe(fds) == 0)
+        {
+            for (const int fd : fds)
+            {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+            read_fd_ = fds[0];
+            write_fd_ = fds[1];
+        }
+#endif
+        if (read_fd_ < 0)
+        {
+            throw std::runtime_error("streaming to an event loop is not supported here");
+        }
+    }
+
+    StreamChannel::~StreamChannel()
+    {
+#if GEMMA_CPP_PYTHON_HAVE_EVENTFD || GEMMA_CPP_PYTHON_HAVE_PIPE
+        close(read_fd_);
+        if (write_fd_ != read_fd_)
+        {
+            close(write_fd_);
+        }
+#endif
+    }
+
+    void StreamChannel::Push(const std::string &piece)
+    {
+        pending_ += piece;
+        if (ring_.TryPush(std::move(pending_)))
+        {
+            pending_.clear(); // moved from
+            Notify();
+        }
+    }
+
+    void StreamChannel::Close()
+    {
+        if (!pending_.empty() && !ring_.TryPush(std::move(pending_)))
+        {
+            tail_ = std::move(pending_);
+        }
+        pending_.clear();
+        closed_.store(true, std::memory_order_release);
+        Notify();
+    }
+
+    bool StreamChannel::Read(std::string &text)
+    {
+        notified_.store(false);
+#if GEMMA_CPP_PYTHON_HAVE_EVENTFD || GEMMA_CPP_PYTHON_HAVE_PIPE
+        char buffer[64];
+        while (read(read_fd_, buffer, sizeof(buffer)) > 0)
+        {
+        }
+#endif
+        // Everything pushed before Close() is in the ring once closed_ is set.
+        const bool closed = closed_.load(std::memory_order_acquire);
+        while (ring_.TryPop(scratch_))
+        {
+            text += scratch_;
+        }
+        if (closed)
+        {
+            text += tail_;
+            tail_.clear();
+        }
+        return closed;
+    }
+
+    void StreamChannel::Notify()
+    {
+        if (notified_.exchange(true))
+        {
+            return; // the consumer has not read the last wakeup yet
+        }
+#if GEMMA_CPP_PYTHON_HAVE_EVENTFD
+        const uint64_t one = 1;
+        (void)!write(write_fd_, &one, sizeof(one));
+#elif GEMMA_CPP_PYTHON_HAVE_PIPE
+        const char one = 1;
+        (void)!write(write_fd_, &one, sizeof(one));
+#endif
+    }
+
+} // namespace gcpp
@@ -0,0 +1,58 @@
+#ifndef GEMMA_CPP_PYTHON_STREAM_CHANNEL_H_
+#define GEMMA_CPP_PYTHON_STREAM_CHANNEL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+#include "spsc_ring.h"
+
+namespace gcpp
+{
+
+    // Hands the text of one generation from the thread producing it to one
+    // consumer without locks. Pieces go through an SpscRing, and the consumer
+    // is woken through a file descriptor it can poll, e.g. with asyncio's
+    // loop.add_reader: an eventfd on Linux, a pipe on other POSIX systems.
+    // The producer never waits: while the ring is full it joins new text
+    // into one pending piece, so a slow consumer gets fewer, larger pieces.
+    class StreamChannel
+    {
+    public:
+        // Throws std::runtime_error if no descriptor can be created, e.g.
+        // on platforms without eventfd or pipes.
+        explicit StreamChannel(size_t capacity = 256);
+        ~StreamChannel();
+
+        StreamChannel(const StreamChannel &) = delete;
+        StreamChannel &operator=(const StreamChannel &) = delete;
+
+        // Producer: queues `piece`.
+        void Push(const std::string &piece);
+
+        // Producer: ends the stream after the last Push().
+        void Close();
+
+        // Becomes readable when there is text to read or the stream closed.
+        int Fd() const { return read_fd_; }
+
+        // Consumer: appends all text available to `text`. Returns true once
+        // the stream is closed and everything was read.
+        bool Read(std::string &text);
+
+    private:
+        void Notify();
+
+        SpscRing<std::string> ring_;
+        std::string pending_;     // producer only: text that did not fit
+        std::string tail_;        // pending_ at Close(), published by closed_
+        std::atomic<bool> closed_{false};
+        std::atomic<bool> notified_{false}; // a wakeup is queued on the descriptor
+        int read_fd_ = -1;
+        int write_fd_ = -1; // == read_fd_ for an eventfd
+        std::string scratch_; // consumer only
+    };
+
+} // namespace gcpp
+
+#endif // GEMMA_CPP_PYTHON_STREAM_CHANNEL_H_
@@ -0,0 +1,150 @@
+#ifndef GEMMA_CPP_PYTHON_TEXT_STREAM_H_
+#define GEMMA_CPP_PYTHON_TEXT_STREAM_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "hwy/base.h"
+
+namespace gcpp
+{
+
+    // Number of bytes at the end of `text` that form an incomplete UTF-8
+    // sequence (0 if the text ends on a character boundary).
+    inline size_t IncompleteUtf8Tail(const std::string &text)
+    {
+        const size_t size = text.size();
+        for (size_t back = 1; back <= 4 && back <= size; ++back)
+        {
+            const unsigned char c = text[size - back];
+            if ((c & 0xC0) == 0x80)
+            {
+                continue; // continuation byte, keep looking for the lead byte
+            }
+            const size_t length = (c & 0x80) == 0x00   ? 1
+                                  : (c & 0xE0) == 0xC0 ? 2
+                                  : (c & 0xF0) == 0xE0 ? 3
+                                  : (c & 0xF8) == 0xF0 ? 4
+                                                       : 1;
+            return length > back ? back : 0;
+        }
+        return 0;
+    }
+
+    // Detokenizes generated tokens one at a time. SentencePiece output for a
+    // token depends on its neighbours (leading U+2581 spaces, byte-fallback
+    // pieces of one multi-byte character), so each Push decodes the few tokens
+    // since the last emitted boundary and returns only the new text, holding
+    // it back while it still ends in a partial character. The returned text
+    // lives in a buffer that is reused by the next call. `Tokenizer` is a
+    // sentencepiece::SentencePieceProcessor, or anything with its Decode().
+    template <class Tokenizer>
+    class BasicStreamDecoder
+    {
+    public:
+        explicit BasicStreamDecoder(const Tokenizer &tokenizer) : tokenizer_(tokenizer) {}
+
+        void Reserve(size_t num_tokens) { tokens_.reserve(num_tokens); }
+
+        // Returns the text completed by `token`, possibly empty.
+        const std::string &Push(int token)
+        {
+            tokens_.push_back(token);
+            piece_.clear();
+            Decode(prefix_offset_, read_offset_, &prefix_text_);
+            Decode(prefix_offset_, tokens_.size(), &text_);
+            if (text_.size() <= prefix_text_.size() || EndsIncomplete(text_))
+            {
+                return piece_;
+            }
+            prefix_offset_ = read_offset_;
+            read_offset_ = tokens_.size();
+            piece_.assign(text_, prefix_text_.size(), std::string::npos);
+            return piece_;
+        }
+
+        // Returns whatever is still held back, e.g. after the last token.
+        const std::string &Flush()
+        {
+            piece_.clear();
+            Decode(prefix_offset_, read_offset_, &prefix_text_);
+            Decode(prefix_offset_, tokens_.size(), &text_);
+            prefix_offset_ = read_offset_ = tokens_.size();
+            if (text_.size() > prefix_text_.size())
+            {
+                piece_.assign(text_, prefix_text_.size(), std::string::npos);
+            }
+            return piece_;
+        }
+
+    private:
+        void Decode(size_t begin, size_t end, std::string *text)
+        {
+            window_.assign(tokens_.begin() + begin, tokens_.begin() + end);
+            HWY_ASSERT(tokenizer_.Decode(window_, text).ok());
+        }
+
+        // SentencePiece maps an unfinished byte sequence to U+FFFD.
+        static bool EndsIncomplete(const std::string &text)
+        {
+            static const std::string kReplacement = "\xEF\xBF\xBD";
+            return IncompleteUtf8Tail(text) != 0 ||
+                   (text.size() >= kReplacement.size() &&
+                    text.compare(text.size() - kReplacement.size(),
+                                 kReplacement.size(), kReplacement) == 0);
+        }
+
+        const Tokenizer &tokenizer_;
+        std::vector<int> tokens_;
+        std::vector<int> window_;
+        std::string prefix_text_; // scratch for Push and Flush
+        std::string text_;
+        std::string piece_; // the text last returned
+        size_t prefix_offset_ = 0; // start of the tokens decoded for context
+        size_t read_offset_ = 0;   // end of the tokens already emitted
+    };
+
+    // Start of the first of the `stop` strings in `text` that ends after
+    // `old_size`, or npos. Only the text after `old_size` and the suffix
+    // before it that was held back (not yet streamed, i.e. at or after
+    // `streamed`) are searched.
+    inline size_t FindStop(const std::string &text, const std::vector<std::string> &stop,
+                           size_t old_size, size_t streamed)
+    {
+        size_t first = std::string::npos;
+        for (const std::string &candidate : stop)
+        {
+            const size_t from = old_size + 1 > candidate.size()
+                                    ? old_size + 1 - candidate.size()
+                                    : 0;
+            first = std::min(first, text.find(candidate, std::max(from, streamed)));
+        }
+        return first;
+    }
+
+    // Length of the longest suffix of `text` that starts one of the `stop`
+    // strings, so it must be held back, at most the text after `streamed`.
+    inline size_t HeldBack(const std::string &text, const std::vector<std::string> &stop,
+                           size_t streamed)
+    {
+        size_t held = 0;
+        for (const std::string &candidate : stop)
+        {
+            for (size_t length = std::min(candidate.size() - 1, text.size()); length > held;
+                 --length)
+            {
+                if (text.compare(text.size() - length, length, candidate, 0, length) == 0)
+                {
+                    held = length;
+                    break;
+                }
+            }
+        }
+        return std::min(held, text.size() - streamed);
+    }
+
+} // namespace gcpp
+
+#endif // GEMMA_CPP_PYTHON_TEXT_STREAM_H_
@@ -0,0 +1,479 @@
+#include "threading.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <set>
+#include <thread> // NOLINT
+#include <tuple>
+#include <utility>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace gcpp
+{
+
+    namespace
+    {
+
+        // First line of a sysfs file, or "" if it cannot be read.
+        std::string ReadSysfs(const std::string &path)
+        {
+            std::ifstream file(path);
+            std::string line;
+            std::getline(file, line);
+            return line;
+        }
+
+        size_t ReadSysfsNumber(const std::string &path, size_t fallback)
+        {
+            const std::string text = ReadSysfs(path);
+            char *end = nullptr;
+            const unsigned long value = strtoul(text.c_str(), &end, 10);
+            return end == text.c_str() ? fallback : value;
+        }
+
+        // Lowest CPU of the cpulist in a sysfs file, or `fallback`.
+        size_t ReadSysfsFirstCpu(const std::string &path, size_t fallback)
+        {
+            std::vector<size_t> cpus;
+            if (!ParseCpuList(ReadSysfs(path), &cpus) || cpus.empty())
+            {
+                return fallback;
+            }
+            return *std::min_element(cpus.begin(), cpus.end());
+        }
+
+        // Maps CPU numbers to NUMA nodes; empty without NUMA information.
+        std::map<size_t, size_t> DetectNodes()
+        {
+            std::map<size_t, size_t> node_of_cpu;
+#ifdef __linux__
+            DIR *dir = opendir("/sys/devices/system/node");
+            if (dir == nullptr)
+            {
+                return node_of_cpu;
+            }
+            while (const dirent *entry = readdir(dir))
+            {
+                const std::string name = entry->d_name;
+                if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+                    name.find_first_not_of("0123456789", 4) != std::string::npos)
+                {
+                    continue;
+                }
+                const size_t node = strtoul(name.c_str() + 4, nullptr, 10);
+                std::vector<size_t> cpus;
+                if (ParseCpuList(ReadSysfs("/sys/devices/system/node/" + name + "/cpulist"), &cpus))
+                {
+                    for (const size_t cpu : cpus)
+                    {
+                        node_of_cpu[cpu] = node;
+                    }
+                }
+            }
+            closedir(dir);
+#endif
+            return node_of_cpu;
+        }
+
+        std::vector<CpuInfo> Detect()
+        {
+            std::vector<size_t> allowed = CurrentThreadAffinity();
+            if (allowed.empty())
+            {
+                const size_t num_cpus = std::max(1u, std::thread::hardware_concurrency());
+                for (size_t cpu = 0; cpu < num_cpus; ++cpu)
+                {
+                    allowed.push_back(cpu);
+                }
+            }
+            const std::map<size_t, size_t> node_of_cpu = DetectNodes();
+
+            std::vector<CpuInfo> topology;
+            for (const size_t cpu : allowed)
+            {
+                const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+                CpuInfo info;
+                info.cpu = cpu;
+                info.package = ReadSysfsNumber(dir + "/topology/physical_package_id", 0);
+                info.core = ReadSysfsFirstCpu(dir + "/topology/thread_siblings_list", cpu);
+                info.l3 = info.package; // one L3 per package unless sysfs says otherwise
+                for (int index = 0; index < 8; ++index)
+                {
+                    const std::string cache = dir + "/cache/index" + std::to_string(index);
+                    if (ReadSysfsNumber(cache + "/level", 0) == 3)
+                    {
+                        info.l3 = ReadSysfsFirstCpu(cache + "/shared_cpu_list", info.l3);
+                        break;
+                    }
+                }
+                const auto node = node_of_cpu.find(cpu);
+                info.node = node == node_of_cpu.end() ? 0 : node->second;
+                topology.push_back(info);
+            }
+            return topology;
+        }
+
+    } // namespace
+
+    const std::vector<CpuInfo> &DetectTopology()
+    {
+        static const std::vector<CpuInfo> topology = Detect();
+        return topology;
+    }
+
+    bool ParseCpuList(const std::string &list, std::vector<size_t> *cpus)
+    {
+        cpus->clear();
+        size_t pos = 0;
+        while (pos < list.size())
+        {
+            const size_t comma = std::min(list.find(',', pos), list.size());
+            const std::string range = list.substr(pos, comma - pos);
+            pos = comma + 1;
+            if (range.empty())
+            {
+                continue;
+            }
+            char *end = nullptr;
+            const size_t first = strtoul(range.c_str(), &end, 10);
+            size_t last = first;
+            if (end == range.c_str())
+            {
+                return false;
+            }
+            if (*end == '-')
+            {
+                const char *begin = end + 1;
+                last = strtoul(begin, &end, 10);
+                if (end == begin || last < first)
+                {
+                    return false;
+                }
+            }
+            if (*end != '\0')
+            {
+                return false;
+            }
+            for (size_t cpu = first; cpu <= last; ++cpu)
+            {
+                cpus->push_back(cpu);
+            }
+        }
+        return true;
+    }
+
+    size_t NumCores(const std::vector<CpuInfo> &topology)
+    {
+        std::set<size_t> cores;
+        for (const CpuInfo &info : topology)
+        {
+            cores.insert(info.core);
+        }
+        return cores.size();
+    }
+
+    std::vector<size_t> PinOrder(PinPolicy policy, const std::vector<CpuInfo> &topology)
+    {
+        std::vector<size_t> order;
+        if (policy == PinPolicy::kNone)
+        {
+            return order;
+        }
+        std::vector<CpuInfo> cpus = topology;
+        std::sort(cpus.begin(), cpus.end(), [](const CpuInfo &a, const CpuInfo &b)
+                  { return std::tie(a.package, a.l3, a.core, a.cpu) <
+                           std::tie(b.package, b.l3, b.core, b.cpu); });
+        if (policy == PinPolicy::kCores)
+        {
+            // The first CPU of each core, then the SMT siblings in the same
+            // order, for pools with more threads than cores.
+            std::set<size_t> cores;
+            std::vector<CpuInfo> siblings;
+            std::vector<CpuInfo> first;
+            for (const CpuInfo &info : cpus)
+            {
+                (cores.insert(info.core).second ? first : siblings).push_back(info);
+            }
+            first.insert(first.end(), siblings.begin(), siblings.end());
+            cpus.swap(first);
+        }
+        if (policy != PinPolicy::kScatter)
+        {
+            for (const CpuInfo &info : cpus)
+            {
+                order.push_back(info.cpu);
+            }
+            return order;
+        }
+
+        // kScatter: take one CPU from each package in turn.
+        std::map<size_t, std::vector<size_t>> by_package;
+        for (const CpuInfo &info : cpus)
+        {
+            by_package[info.package].push_back(info.cpu);
+        }
+        for (size_t i = 0; order.size() < cpus.size(); ++i)
+        {
+            for (const auto &package : by_package)
+            {
+                if (i < package.second.size())
+                {
+                    order.push_back(package.second[i]);
+                }
+            }
+        }
+        return order;
+    }
+
+    bool PinCurrentThread(const std::vector<size_t> &cpus)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (const size_t cpu : cpus)
+        {
+            if (cpu < CPU_SETSIZE)
+            {
+                CPU_SET(cpu, &set);
+            }
+        }
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        (void)cpus;
+        return false;
+#endif
+    }
+
+    std::vector<size_t> CurrentThreadAffinity()
+    {
+        std::vector<size_t> cpus;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+        {
+            for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+                if (CPU_ISSET(cpu, &set))
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+#endif
+        return cpus;
+    }
+
+    const char *ThreadingArgs::Validate() const
+    {
+        if (pin != "auto" && pin != "none" && pin != "compact" && pin != "scatter" &&
+            pin != "cores")
+        {
+            return "--pin must be one of auto, none, compact, scatter or cores.";
+        }
+        std::vector<size_t> list;
+        if (!ParseCpuList(cpus, &list))
+        {
+            return "--cpus must be a cpulist such as 0-15,32-47.";
+        }
+        if (!cpus.empty() && Cpus().empty())
+        {
+            return "--cpus does not name any CPU this process may run on.";
+        }
+        return nullptr;
+    }
+
+    PinPolicy ThreadingArgs::Policy(size_t num_threads) const
+    {
+        if (pin == "compact")
+        {
+            return PinPolicy::kCompact;
+        }
+        if (pin == "scatter")
+        {
+            return PinPolicy::kScatter;
+        }
+        if (pin == "cores")
+        {
+            return PinPolicy::kCores;
+        }
+        if (pin == "auto")
+        {
+            // For many-core, pinning threads to cores helps. kCompact would
+            // put two threads on the siblings of one core.
+            return num_threads > 10 ? PinPolicy::kCores : PinPolicy::kNone;
+        }
+        return PinPolicy::kNone;
+    }
+
+    std::vector<CpuInfo> ThreadingArgs::Cpus() const
+    {
+        const std::vector<CpuInfo> &topology = DetectTopology();
+        std::vector<size_t> list;
+        if (cpus.empty() || !ParseCpuList(cpus, &list))
+        {
+            return topology;
+        }
+        std::vector<CpuInfo> selected;
+        for (const CpuInfo &info : topology)
+        {
+            if (std::find(list.begin(), list.end(), info.cpu) != list.end())
+            {
+                selected.push_back(info);
+            }
+        }
+        return selected;
+    }
+
+    size_t ThreadingArgs::DefaultNumThreads() const
+    {
+        return std::max<size_t>(NumCores(Cpus()), 1);
+    }
+
+    PoolSet::PoolSet(size_t num_threads, std::vector<size_t> pin_cpus)
+        : pin_cpus_(std::move(pin_cpus)),
+          num_threads_(num_threads),
+          inner_pool_(std::make_unique<hwy::ThreadPool>(0)),
+          pool_(std::make_unique<hwy::ThreadPool>(num_threads)),
+          detach_lock_(mutex_, std::defer_lock)
+    {
+        PinWorkers();
+    }
+
+    void PoolSet::PinWorkers()
+    {
+        if (!pin_cpus_.empty())
+        {
+            pool_->Run(0, pool_->NumThreads(),
+                       [this](uint64_t /*task*/, size_t thread)
+                       { PinCurrentThread({pin_cpus_[thread % pin_cpus_.size()]}); });
+        }
+    }
+
+    void PoolSet::Detach()
+    {
+        detach_lock_.lock();
+        pool_.reset(); // joins the workers
+    }
+
+    void PoolSet::Reattach()
+    {
+        pool_ = std::make_unique<hwy::ThreadPool>(num_threads_);
+        PinWorkers();
+        detach_lock_.unlock();
+    }
+
+    namespace
+    {
+
+        // Live pools by (num_threads, pin_cpus), plus the state of DetachPools().
+        struct PoolRegistry
+        {
+            std::mutex mutex;
+            std::map<std::pair<size_t, std::vector<size_t>>, std::weak_ptr<PoolSet>> pools;
+            std::unique_lock<std::mutex> detach_lock{mutex, std::defer_lock};
+            std::vector<std::shared_ptr<PoolSet>> detached; // kept alive until reattached
+            std::atomic<size_t> detach_depth{0};
+        };
+
+        PoolRegistry &Registry()
+        {
+            static PoolRegistry *registry = new PoolRegistry(); // outlives atexit handlers
+            return *registry;
+        }
+
+    } // namespace
+
+    std::shared_ptr<PoolSet> AcquirePools(size_t num_threads, const ThreadingArgs &threading)
+    {
+        const std::vector<size_t> order = PinOrder(threading.Policy(num_threads), threading.Cpus());
+        std::vector<size_t> pin_cpus;
+        for (size_t thread = 0; thread < num_threads && !order.empty(); ++thread)
+        {
+            pin_cpus.push_back(order[thread % order.size()]);
+        }
+
+        PoolRegistry &registry = Registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        std::weak_ptr<PoolSet> &entry = registry.pools[std::make_pair(num_threads, pin_cpus)];
+        std::shared_ptr<PoolSet> pool_set = entry.lock();
+        if (!pool_set)
+        {
+            pool_set = std::make_shared<PoolSet>(num_threads, std::move(pin_cpus));
+            entry = pool_set;
+        }
+        return pool_set;
+    }
+
+    void DetachPools()
+    {
+        PoolRegistry &registry = Registry();
+        if (registry.detach_depth.fetch_add(1) != 0)
+        {
+            return;
+        }
+        registry.detach_lock.lock();
+        for (const auto &entry : registry.pools)
+        {
+            if (std::shared_ptr<PoolSet> pool_set = entry.second.lock())
+            {
+                pool_set->Detach();
+                registry.detached.push_back(std::move(pool_set));
+            }
+        }
+    }
+
+    void ReattachPools()
+    {
+        PoolRegistry &registry = Registry();
+        size_t depth = registry.detach_depth.load();
+        do
+        {
+            if (depth == 0)
+            {
+                return;
+            }
+        } while (!registry.detach_depth.compare_exchange_weak(depth, depth - 1));
+        if (depth != 1)
+        {
+            return;
+        }
+        for (const std::shared_ptr<PoolSet> &pool_set : registry.detached)
+        {
+            pool_set->Reattach();
+        }
+        std::vector<std::shared_ptr<PoolSet>> detached;
+        detached.swap(registry.detached);
+        registry.detach_lock.unlock();
+        // A model released meanwhile drops its pools here, outside the lock.
+    }
+
+    ScopedAffinity::ScopedAffinity(const std::vector<size_t> &cpus)
+    {
+        if (!cpus.empty())
+        {
+            previous_ = CurrentThreadAffinity();
+            if (!previous_.empty() && !PinCurrentThread(cpus))
+            {
+                previous_.clear();
+            }
+        }
+    }
+
+    ScopedAffinity::~ScopedAffinity()
+    {
+        if (!previous_.empty())
+        {
+            PinCurrentThread(previous_);
+        }
+    }
+
+} // namespace gcpp
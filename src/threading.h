@@ -0,0 +1,163 @@
+#ifndef GEMMA_CPP_PYTHON_THREADING_H_
+#define GEMMA_CPP_PYTHON_THREADING_H_
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "util/args.h"
+#include "hwy/contrib/thread_pool/thread_pool.h"
+
+namespace gcpp
+{
+
+    // One logical CPU and where it sits in the machine.
+    struct CpuInfo
+    {
+        size_t cpu;     // OS CPU number
+        size_t package; // socket
+        size_t l3;      // L3 domain, named by its lowest CPU
+        size_t core;    // physical core, named by its lowest SMT sibling
+        size_t node;    // NUMA node
+    };
+
+    // The CPUs in this process's affinity mask, detected once. On Linux the
+    // layout comes from sysfs; elsewhere all CPUs are reported as separate
+    // cores of one package, L3 domain and node.
+    const std::vector<CpuInfo> &DetectTopology();
+
+    enum class PinPolicy
+    {
+        kNone,    // leave placement to the OS
+        kCompact, // fill cores, then L3 domains, then sockets, in order
+        kScatter, // like kCompact, but round-robin over the sockets
+        kCores,   // like kCompact, but one CPU per physical core before any SMT sibling
+    };
+
+    // Parses a Linux cpulist such as "0-3,8,10-11". Returns false if malformed.
+    bool ParseCpuList(const std::string &list, std::vector<size_t> *cpus);
+
+    // Number of distinct physical cores in `topology`.
+    size_t NumCores(const std::vector<CpuInfo> &topology);
+
+    // Returns the order in which pool threads are assigned to the CPUs of
+    // `topology`, or an empty vector for PinPolicy::kNone.
+    std::vector<size_t> PinOrder(PinPolicy policy, const std::vector<CpuInfo> &topology);
+
+    // Restricts the calling thread to `cpus`. Returns false where unsupported.
+    bool PinCurrentThread(const std::vector<size_t> &cpus);
+
+    // CPUs the calling thread may run on; empty where unsupported.
+    std::vector<size_t> CurrentThreadAffinity();
+
+    // Thread pinning flags, parsed from the same arguments as AppArgs.
+    class ThreadingArgs : public ArgsBase<ThreadingArgs>
+    {
+    public:
+        ThreadingArgs(int argc, char *argv[]) { InitAndParse(argc, argv); }
+
+        // Returns error string or nullptr if OK.
+        const char *Validate() const;
+
+        // Resolves "auto" for a pool of `num_threads` threads: kCores above
+        // 10 threads, so that each thread gets a core of its own, else kNone.
+        PinPolicy Policy(size_t num_threads) const;
+
+        // The detected CPUs restricted to --cpus, if given.
+        std::vector<CpuInfo> Cpus() const;
+
+        // One thread per physical core of Cpus(); under "auto", each of them
+        // is pinned to a core of its own.
+        size_t DefaultNumThreads() const;
+
+        std::string pin;
+        std::string cpus;
+
+        template <class Visitor>
+        void ForEach(const Visitor &visitor)
+        {
+            visitor(pin, "pin", std::string("auto"),
+                    "Thread pinning policy: auto, none, compact, scatter or cores.\n"
+                    "    auto pins one thread per physical core when using more than 10 threads.",
+                    2);
+            visitor(cpus, "cpus", std::string(),
+                    "CPUs the thread pools may use, e.g. 0-15,32-47.\n"
+                    "    Default: all CPUs in the process affinity mask.",
+                    2);
+        }
+    };
+
+    // A pool and inner pool shared by every model in the process that asks
+    // for the same configuration. The workers are pinned once, when the pools
+    // are created. The pools run one job at a time, so users hold Mutex()
+    // while generating.
+    //
+    // Worker threads do not survive fork(). Detach() joins them and holds
+    // Mutex(), so generation waits; Reattach() starts and pins new workers,
+    // in the parent or in the forked child, and releases it.
+    class PoolSet
+    {
+    public:
+        PoolSet(size_t num_threads, std::vector<size_t> pin_cpus);
+
+        PoolSet(const PoolSet &) = delete;
+        PoolSet &operator=(const PoolSet &) = delete;
+
+        hwy::ThreadPool &Pool() { return *pool_; }
+        hwy::ThreadPool &InnerPool() { return *inner_pool_; }
+        std::mutex &Mutex() { return mutex_; }
+
+        void Detach();
+        void Reattach();
+
+        // CPUs the workers are pinned to, in worker order; empty if unpinned.
+        const std::vector<size_t> &PinCpus() const { return pin_cpus_; }
+
+    private:
+        void PinWorkers();
+
+        std::vector<size_t> pin_cpus_;
+        size_t num_threads_;
+        // Has no workers: gemma.cpp's prefill calls it from several outer
+        // workers at once, and hwy::ThreadPool::Run must not be called
+        // concurrently, so nested work runs on the calling worker.
+        std::unique_ptr<hwy::ThreadPool> inner_pool_;
+        std::unique_ptr<hwy::ThreadPool> pool_;
+        std::mutex mutex_;
+        std::unique_lock<std::mutex> detach_lock_; // owns mutex_ while detached
+    };
+
+    // Returns the process-wide pools for `num_threads` threads under the
+    // pinning flags, creating them on first use. Pools are released when the
+    // last model using them goes away.
+    std::shared_ptr<PoolSet> AcquirePools(size_t num_threads, const ThreadingArgs &threading);
+
+    // Detaches every PoolSet in the process before fork(), so that weights
+    // loaded earlier are shared copy-on-write with the children. Waits for
+    // running generations; until ReattachPools(), generation and AcquirePools
+    // block. Both must be called from the same thread, which in the child is
+    // the one that forked. Nested calls are counted.
+    void DetachPools();
+    void ReattachPools();
+
+    // Restricts the calling thread to `cpus` for its lifetime, e.g. so that
+    // memory first touched while loading weights lands on the pool's NUMA
+    // node when the pool has only one. Does nothing for an empty set.
+    class ScopedAffinity
+    {
+    public:
+        explicit ScopedAffinity(const std::vector<size_t> &cpus);
+        ~ScopedAffinity();
+
+        ScopedAffinity(const ScopedAffinity &) = delete;
+        ScopedAffinity &operator=(const ScopedAffinity &) = delete;
+
+    private:
+        std::vector<size_t> previous_;
+    };
+
+} // namespace gcpp
+
+#endif // GEMMA_CPP_PYTHON_THREADING_H_
@@ -0,0 +1,88 @@
+#include "async_consumer.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <thread> // NOLINT
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace gcpp
+{
+    namespace
+    {
+
+        TEST(AsyncConsumerTest, ConsumesEverythingInOrderBeforeDrainReturns)
+        {
+            std::vector<int> consumed;
+            AsyncConsumer<int> consumer(16, [&consumed](int &value)
+                                        {
+                                            consumed.push_back(value);
+                                            return true; });
+            std::vector<int> expected;
+            for (int i = 0; i < 1000; ++i)
+            {
+                EXPECT_TRUE(consumer.Push(i));
+                expected.push_back(i);
+            }
+            consumer.Drain();
+            EXPECT_EQ(consumed, expected);
+
+            // The consumer parks while idle and wakes for the next value.
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            EXPECT_TRUE(consumer.Push(1000));
+            consumer.Drain();
+            EXPECT_EQ(consumed.size(), 1001u);
+        }
+
+        TEST(AsyncConsumerTest, StopsAfterConsumeReturnsFalse)
+        {
+            std::vector<int> consumed;
+            AsyncConsumer<int> consumer(8, [&consumed](int &value)
+                                        {
+                                            consumed.push_back(value);
+                                            return value < 2; });
+            for (int i = 0; i < 5; ++i)
+            {
+                consumer.Push(i);
+            }
+            consumer.Drain();
+            EXPECT_EQ(consumed, (std::vector<int>{0, 1, 2}));
+            EXPECT_FALSE(consumer.Push(5));
+        }
+
+        TEST(AsyncConsumerTest, DrainRethrows)
+        {
+            AsyncConsumer<int> consumer(8, [](int &value)
+                                        {
+                                            if (value == 1)
+                                            {
+                                                throw std::runtime_error("bad value");
+                                            }
+                                            return true; });
+            consumer.Push(0);
+            consumer.Push(1);
+            consumer.Push(2);
+            EXPECT_THROW(consumer.Drain(), std::runtime_error);
+            consumer.Drain(); // the error is reported once
+        }
+
+        TEST(AsyncConsumerTest, DestructorConsumesWhatIsQueued)
+        {
+            int consumed = 0;
+            {
+                AsyncConsumer<int> consumer(4, [&consumed](int &)
+                                            {
+                                                std::this_thread::sleep_for(std::chrono::microseconds(50));
+                                                ++consumed;
+                                                return true; });
+                for (int i = 0; i < 100; ++i)
+                {
+                    consumer.Push(i);
+                }
+            }
+            EXPECT_EQ(consumed, 100);
+        }
+
+    } // namespace
+} // namespace gcpp
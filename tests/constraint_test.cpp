@@ -0,0 +1,145 @@
+#include "constraint.h"
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace gcpp
+{
+    namespace
+    {
+
+        // Token i < 256 is the single byte i; 256 is EOS.
+        constexpr int kEos = 256;
+
+        std::shared_ptr<const std::vector<std::string>> ByteVocabulary()
+        {
+            auto tokens = std::make_shared<std::vector<std::string>>();
+            for (int byte = 0; byte < 256; ++byte)
+            {
+                tokens->push_back(std::string(1, static_cast<char>(byte)));
+            }
+            tokens->push_back(std::string()); // EOS
+            return tokens;
+        }
+
+        // Feeds `text` byte by byte. Returns false if a byte is not allowed,
+        // otherwise whether EOS is allowed afterwards.
+        bool Matches(const std::string &pattern, const std::string &text)
+        {
+            ConstraintMatcher matcher(
+                std::make_shared<RegexConstraint>(pattern, ByteVocabulary(), kEos));
+            for (const char c : text)
+            {
+                if (!matcher.Advance(static_cast<unsigned char>(c)))
+                {
+                    return false;
+                }
+            }
+            return matcher.Accept(kEos);
+        }
+
+        TEST(RegexConstraintTest, QuantifierBounds)
+        {
+            EXPECT_FALSE(Matches("a{2,3}", "a"));
+            EXPECT_TRUE(Matches("a{2,3}", "aa"));
+            EXPECT_TRUE(Matches("a{2,3}", "aaa"));
+            EXPECT_FALSE(Matches("a{2,3}", "aaaa"));
+            EXPECT_TRUE(Matches("a{2}b", "aab"));
+            EXPECT_FALSE(Matches("a{2}b", "ab"));
+            EXPECT_TRUE(Matches("a{2,}", "aaaaaaa"));
+            EXPECT_FALSE(Matches("a{2,}", "a"));
+            EXPECT_TRUE(Matches("(ab){0,2}", ""));
+            EXPECT_TRUE(Matches("(ab){0,2}", "abab"));
+            EXPECT_FALSE(Matches("(ab){0,2}", "ababab"));
+        }
+
+        TEST(RegexConstraintTest, MalformedPatternsThrow)
+        {
+            const auto compile = [](const std::string &pattern)
+            { RegexConstraint(pattern, ByteVocabulary(), kEos); };
+            EXPECT_THROW(compile("a{3,2}"), std::invalid_argument);
+            EXPECT_THROW(compile("(ab"), std::invalid_argument);
+            EXPECT_THROW(compile("ab)"), std::invalid_argument);
+            EXPECT_THROW(compile("[a-"), std::invalid_argument);
+            EXPECT_THROW(compile("*a"), std::invalid_argument);
+            EXPECT_THROW(RegexConstraint::CheckPattern("a{3,2}"), std::invalid_argument);
+            EXPECT_THROW(RegexConstraint::CheckPattern("[^"), std::invalid_argument);
+            EXPECT_NO_THROW(RegexConstraint::CheckPattern("(yes|no){1,3}[^a-z]*"));
+        }
+
+        TEST(RegexConstraintTest, NegatedClassMatchesNonAsciiBytes)
+        {
+            const std::string pattern = "\"[^\"\\\\]*\"";
+            EXPECT_TRUE(Matches(pattern, "\"caf\xC3\xA9\""));
+            EXPECT_TRUE(Matches(pattern, "\"\xE2\x82\xAC 5\""));
+            EXPECT_FALSE(Matches(pattern, "\"a\"b\""));
+            EXPECT_FALSE(Matches(pattern, "\"a\\\""));
+            EXPECT_TRUE(Matches("[^a-z]+", "\xF0\x9F\x98\x80" "123"));
+            EXPECT_FALSE(Matches("[^a-z]+", "\xC3\xA9x"));
+        }
+
+        TEST(RegexConstraintTest, AlternationInsideGroups)
+        {
+            EXPECT_TRUE(Matches("(ab|cd)+e", "abcde"));
+            EXPECT_TRUE(Matches("(ab|cd)+e", "cdcdabe"));
+            EXPECT_FALSE(Matches("(ab|cd)+e", "e"));
+            EXPECT_FALSE(Matches("(ab|cd)+e", "ace"));
+            EXPECT_TRUE(Matches("(?:x|yz)?w", "w"));
+            EXPECT_TRUE(Matches("(?:x|yz)?w", "yzw"));
+            EXPECT_FALSE(Matches("(?:x|yz)?w", "xyzw"));
+            EXPECT_TRUE(Matches("(yes|no|(maybe|perhaps) later)", "perhaps later"));
+            EXPECT_FALSE(Matches("(yes|no|(maybe|perhaps) later)", "maybe"));
+        }
+
+        TEST(RegexConstraintTest, EosOnlyWhenTextMatches)
+        {
+            ConstraintMatcher matcher(
+                std::make_shared<RegexConstraint>("ab+", ByteVocabulary(), kEos));
+            EXPECT_FALSE(matcher.Accept(kEos));
+            EXPECT_TRUE(matcher.Advance('a'));
+            EXPECT_FALSE(matcher.Accept(kEos));
+            EXPECT_FALSE(matcher.Accept('a'));
+            EXPECT_TRUE(matcher.Advance('b'));
+            EXPECT_TRUE(matcher.Accept(kEos));
+            EXPECT_TRUE(matcher.Advance('b'));
+            EXPECT_TRUE(matcher.Accept(kEos));
+            EXPECT_TRUE(Matches("a*", ""));
+        }
+
+        TEST(RegexConstraintTest, MultiByteTokensCrossStates)
+        {
+            // 0 "a", 1 "bb", 2 "bcd", 3 "cd", 4 "abc", 5 "" (never allowed), 6 EOS.
+            auto tokens = std::make_shared<const std::vector<std::string>>(
+                std::vector<std::string>{"a", "bb", "bcd", "cd", "abc", "", ""});
+            auto constraint = std::make_shared<RegexConstraint>("ab+cd", tokens, 6);
+
+            ConstraintMatcher start(constraint);
+            EXPECT_TRUE(start.Accept(0));
+            EXPECT_FALSE(start.Accept(1));
+            EXPECT_TRUE(start.Accept(4)); // "abc" ends inside the pattern
+            EXPECT_FALSE(start.Accept(5));
+            EXPECT_FALSE(start.Accept(6));
+
+            ConstraintMatcher matcher(constraint);
+            EXPECT_TRUE(matcher.Advance(0));
+            EXPECT_TRUE(matcher.Accept(1));
+            EXPECT_TRUE(matcher.Accept(2));
+            EXPECT_FALSE(matcher.Accept(3)); // needs at least one "b"
+            EXPECT_TRUE(matcher.Advance(2));
+            EXPECT_TRUE(matcher.Accept(6));
+            EXPECT_FALSE(matcher.Accept(0));
+
+            ConstraintMatcher other(constraint);
+            EXPECT_TRUE(other.Advance(4));
+            EXPECT_FALSE(other.Accept(6));
+            EXPECT_FALSE(other.Accept(1));
+            EXPECT_FALSE(other.Accept(0));
+            EXPECT_TRUE(constraint->Next(RegexConstraint::kStart, 3) == RegexConstraint::Dead());
+        }
+
+    } // namespace
+} // namespace gcpp
@@ -0,0 +1,67 @@
+#include "spsc_ring.h"
+
+#include <thread> // NOLINT
+#include <utility>
+
+#include "gtest/gtest.h"
+
+namespace gcpp
+{
+    namespace
+    {
+
+        TEST(SpscRingTest, RoundsCapacityUpAndKeepsOrder)
+        {
+            SpscRing<int> ring(3); // holds 4
+            for (int i = 0; i < 4; ++i)
+            {
+                int value = i;
+                EXPECT_TRUE(ring.TryPush(std::move(value)));
+            }
+            int rejected = 4;
+            EXPECT_FALSE(ring.TryPush(std::move(rejected)));
+            EXPECT_EQ(rejected, 4); // left untouched when full
+
+            int value = -1;
+            for (int i = 0; i < 4; ++i)
+            {
+                ASSERT_TRUE(ring.TryPop(value));
+                EXPECT_EQ(value, i);
+            }
+            EXPECT_FALSE(ring.TryPop(value));
+        }
+
+        TEST(SpscRingTest, ConcurrentProducerAndConsumer)
+        {
+            constexpr int kCount = 100000;
+            SpscRing<int> ring(64);
+            std::thread producer([&ring]
+                                 {
+                                     for (int i = 0; i < kCount; ++i)
+                                     {
+                                         int value = i;
+                                         while (!ring.TryPush(std::move(value)))
+                                         {
+                                             std::this_thread::yield();
+                                         }
+                                     } });
+            int expected = 0;
+            int value;
+            while (expected < kCount)
+            {
+                if (ring.TryPop(value))
+                {
+                    ASSERT_EQ(value, expected);
+                    ++expected;
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+            producer.join();
+            EXPECT_FALSE(ring.TryPop(value));
+        }
+
+    } // namespace
+} // namespace gcpp
@@ -22,10 +22,14 @@ def main():
         "--input", type=str, required=False, help="Input text to chat with the model. If None, Switch to Chat mode.",
         default="Hello."
     )
+    parser.add_argument(
+        "--stream", action="store_true", help="Print the completion as it is generated."
+    )
     # Now using the parsed arguments
     args = parser.parse_args()
     if args.input is not None:
-        string = pygemma.completion(
+        # Weights are loaded once here and reused by every generate() call.
+        model = pygemma.Gemma(
             [
                 "--tokenizer",
                 args.tokenizer,
@@ -33,9 +37,14 @@ def main():
                 args.compressed_weights,
                 "--model",
                 args.model,
-            ], args.input
+            ]
         )
-        print(string)
+        if args.stream:
+            model.generate(args.input, stream=lambda text: print(text, end="", flush=True))
+            print()
+        else:
+            string = model.generate(args.input)
+            print(string)
     else:
         return pygemma.chat_base(
             [
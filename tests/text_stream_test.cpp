@@ -0,0 +1,121 @@
+#include "text_stream.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace gcpp
+{
+    namespace
+    {
+
+        // Decodes like SentencePiece for what StreamDecoder relies on: pieces
+        // are concatenated, the decoded text does not start with a space, and
+        // an unfinished byte sequence at the end becomes U+FFFD.
+        class FakeTokenizer
+        {
+        public:
+            struct Status
+            {
+                bool ok() const { return true; }
+            };
+
+            explicit FakeTokenizer(std::vector<std::string> pieces) : pieces_(std::move(pieces)) {}
+
+            Status Decode(const std::vector<int> &tokens, std::string *text) const
+            {
+                text->clear();
+                for (const int token : tokens)
+                {
+                    *text += pieces_[token];
+                }
+                if (!text->empty() && (*text)[0] == ' ')
+                {
+                    text->erase(0, 1);
+                }
+                if (const size_t tail = IncompleteUtf8Tail(*text))
+                {
+                    text->replace(text->size() - tail, tail, "\xEF\xBF\xBD");
+                }
+                return Status();
+            }
+
+        private:
+            std::vector<std::string> pieces_;
+        };
+
+        TEST(IncompleteUtf8TailTest, CountsUnfinishedBytes)
+        {
+            EXPECT_EQ(IncompleteUtf8Tail(""), 0u);
+            EXPECT_EQ(IncompleteUtf8Tail("abc"), 0u);
+            EXPECT_EQ(IncompleteUtf8Tail("caf\xC3\xA9"), 0u);
+            EXPECT_EQ(IncompleteUtf8Tail("caf\xC3"), 1u);
+            EXPECT_EQ(IncompleteUtf8Tail("\xE2\x82"), 2u);
+            EXPECT_EQ(IncompleteUtf8Tail("\xF0\x9F\x98"), 3u);
+            EXPECT_EQ(IncompleteUtf8Tail("\xF0\x9F\x98\x80"), 0u);
+        }
+
+        TEST(StreamDecoderTest, KeepsSpacesBetweenTokens)
+        {
+            const FakeTokenizer tokenizer({" Hello", " world", "!"});
+            BasicStreamDecoder<FakeTokenizer> decoder(tokenizer);
+            EXPECT_EQ(decoder.Push(0), "Hello");
+            EXPECT_EQ(decoder.Push(1), " world");
+            EXPECT_EQ(decoder.Push(2), "!");
+            EXPECT_EQ(decoder.Flush(), "");
+        }
+
+        TEST(StreamDecoderTest, HoldsBackPartialCharacters)
+        {
+            // "é" split over two byte tokens, and "€" over three.
+            const FakeTokenizer tokenizer({" caf", "\xC3", "\xA9", "\xE2", "\x82", "\xAC"});
+            BasicStreamDecoder<FakeTokenizer> decoder(tokenizer);
+            EXPECT_EQ(decoder.Push(0), "caf");
+            EXPECT_EQ(decoder.Push(1), "");
+            EXPECT_EQ(decoder.Push(2), "\xC3\xA9");
+            EXPECT_EQ(decoder.Push(3), "");
+            EXPECT_EQ(decoder.Push(4), "");
+            EXPECT_EQ(decoder.Push(5), "\xE2\x82\xAC");
+        }
+
+        TEST(StreamDecoderTest, FlushReturnsWhatIsHeldBack)
+        {
+            const FakeTokenizer tokenizer({" a", "\xC3"});
+            BasicStreamDecoder<FakeTokenizer> decoder(tokenizer);
+            EXPECT_EQ(decoder.Push(0), "a");
+            EXPECT_EQ(decoder.Push(1), "");
+            EXPECT_EQ(decoder.Flush(), "\xEF\xBF\xBD");
+            EXPECT_EQ(decoder.Flush(), "");
+        }
+
+        TEST(StopStringTest, FindStopSearchesNewAndHeldBackText)
+        {
+            const std::vector<std::string> stop = {"STOP", "\n\n"};
+            // "abcST" was there before and "ab" of it was streamed.
+            EXPECT_EQ(FindStop("abcSTOP", stop, 5, 2), 3u);
+            EXPECT_EQ(FindStop("abc\n\nx", stop, 4, 3), 3u);
+            EXPECT_EQ(FindStop("abcSTO", stop, 5, 3), std::string::npos);
+            // A stop string entirely in text that was already checked.
+            EXPECT_EQ(FindStop("STOP and more", stop, 10, 10), std::string::npos);
+        }
+
+        TEST(StopStringTest, FindStopReturnsTheFirstMatch)
+        {
+            const std::vector<std::string> stop = {"world", "lo"};
+            EXPECT_EQ(FindStop("hello world", stop, 0, 0), 3u);
+        }
+
+        TEST(StopStringTest, HeldBackIsTheLongestStopPrefix)
+        {
+            const std::vector<std::string> stop = {"world", "wow"};
+            EXPECT_EQ(HeldBack("hello wor", stop, 0), 3u);
+            EXPECT_EQ(HeldBack("hello wo", stop, 0), 2u);
+            EXPECT_EQ(HeldBack("hello", stop, 0), 0u);
+            EXPECT_EQ(HeldBack("hello w", stop, 0), 1u);
+            // Never more than what was not streamed yet.
+            EXPECT_EQ(HeldBack("hello wor", stop, 8), 1u);
+        }
+
+    } // namespace
+} // namespace gcpp
@@ -0,0 +1,154 @@
+#include "threading.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace gcpp
+{
+    namespace
+    {
+
+        TEST(ParseCpuListTest, RangesAndSingles)
+        {
+            std::vector<size_t> cpus;
+            ASSERT_TRUE(ParseCpuList("0-3,8,10-11", &cpus));
+            EXPECT_EQ(cpus, (std::vector<size_t>{0, 1, 2, 3, 8, 10, 11}));
+            ASSERT_TRUE(ParseCpuList("5", &cpus));
+            EXPECT_EQ(cpus, (std::vector<size_t>{5}));
+            ASSERT_TRUE(ParseCpuList("", &cpus));
+            EXPECT_TRUE(cpus.empty());
+        }
+
+        TEST(ParseCpuListTest, Malformed)
+        {
+            std::vector<size_t> cpus;
+            EXPECT_FALSE(ParseCpuList("3-1", &cpus));
+            EXPECT_FALSE(ParseCpuList("a", &cpus));
+            EXPECT_FALSE(ParseCpuList("1-", &cpus));
+            EXPECT_FALSE(ParseCpuList("1-2x", &cpus));
+            EXPECT_FALSE(ParseCpuList("0,2;3", &cpus));
+        }
+
+        // Two packages of two cores with two SMT siblings each; the siblings of
+        // core c are CPUs c and c + 4.
+        std::vector<CpuInfo> TwoSockets()
+        {
+            std::vector<CpuInfo> topology;
+            for (size_t cpu = 0; cpu < 8; ++cpu)
+            {
+                const size_t core = cpu % 4;
+                const size_t package = core / 2;
+                topology.push_back(CpuInfo{cpu, package, package * 2, core, package});
+            }
+            return topology;
+        }
+
+        TEST(PinOrderTest, None)
+        {
+            EXPECT_TRUE(PinOrder(PinPolicy::kNone, TwoSockets()).empty());
+        }
+
+        TEST(PinOrderTest, CompactFillsCoresThenSockets)
+        {
+            EXPECT_EQ(PinOrder(PinPolicy::kCompact, TwoSockets()),
+                      (std::vector<size_t>{0, 4, 1, 5, 2, 6, 3, 7}));
+        }
+
+        TEST(PinOrderTest, CoresPutsSiblingsLast)
+        {
+            EXPECT_EQ(PinOrder(PinPolicy::kCores, TwoSockets()),
+                      (std::vector<size_t>{0, 1, 2, 3, 4, 5, 6, 7}));
+        }
+
+        TEST(PinOrderTest, CoresWithoutTheLowestSibling)
+        {
+            std::vector<CpuInfo> topology = TwoSockets();
+            topology.erase(topology.begin()); // CPU 4 is the only one left of core 0
+            EXPECT_EQ(PinOrder(PinPolicy::kCores, topology),
+                      (std::vector<size_t>{4, 1, 2, 3, 5, 6, 7}));
+        }
+
+        TEST(PinOrderTest, ScatterAlternatesSockets)
+        {
+            EXPECT_EQ(PinOrder(PinPolicy::kScatter, TwoSockets()),
+                      (std::vector<size_t>{0, 2, 4, 6, 1, 3, 5, 7}));
+        }
+
+        TEST(PinOrderTest, ScatterWithUnevenSockets)
+        {
+            std::vector<CpuInfo> topology = TwoSockets();
+            topology.resize(6); // CPUs 0-5: package 0 has 0, 1, 4, 5
+            EXPECT_EQ(PinOrder(PinPolicy::kScatter, topology),
+                      (std::vector<size_t>{0, 2, 4, 3, 1, 5}));
+        }
+
+        ThreadingArgs ParseArgs(std::vector<std::string> flags)
+        {
+            flags.insert(flags.begin(), "threading_test");
+            std::vector<char *> argv;
+            for (std::string &flag : flags)
+            {
+                argv.push_back(&flag[0]);
+            }
+            return ThreadingArgs(static_cast<int>(argv.size()), argv.data());
+        }
+
+        TEST(ThreadingArgsTest, AutoPinsOneThreadPerCore)
+        {
+            const ThreadingArgs args = ParseArgs({});
+            EXPECT_EQ(args.Policy(8), PinPolicy::kNone);
+            EXPECT_EQ(args.Policy(16), PinPolicy::kCores);
+            EXPECT_EQ(ParseArgs({"--pin", "compact"}).Policy(16), PinPolicy::kCompact);
+        }
+
+        TEST(ThreadingArgsTest, DefaultThreadsGetDistinctCores)
+        {
+            // Two packages of eight cores with two SMT siblings each.
+            std::vector<CpuInfo> topology;
+            for (size_t cpu = 0; cpu < 32; ++cpu)
+            {
+                const size_t core = cpu % 16;
+                topology.push_back(CpuInfo{cpu, core / 8, core / 8 * 8, core, core / 8});
+            }
+            const size_t num_threads = NumCores(topology);
+            ASSERT_EQ(num_threads, 16u);
+            const std::vector<size_t> order = PinOrder(ParseArgs({}).Policy(num_threads), topology);
+            ASSERT_EQ(order.size(), 32u);
+            std::set<size_t> cores;
+            std::set<size_t> packages;
+            for (size_t thread = 0; thread < num_threads; ++thread)
+            {
+                cores.insert(topology[order[thread]].core);
+                packages.insert(topology[order[thread]].package);
+            }
+            EXPECT_EQ(cores.size(), num_threads);
+            EXPECT_EQ(packages.size(), 2u);
+        }
+
+        TEST(ThreadingArgsTest, DefaultThreadsOnThisMachine)
+        {
+            const ThreadingArgs args = ParseArgs({});
+            const size_t num_threads = args.DefaultNumThreads();
+            EXPECT_NE(args.Policy(num_threads), PinPolicy::kCompact);
+            const std::vector<CpuInfo> topology = args.Cpus();
+            const std::vector<size_t> order = PinOrder(PinPolicy::kCores, topology);
+            ASSERT_GE(order.size(), num_threads);
+            std::set<size_t> cores;
+            for (size_t thread = 0; thread < num_threads; ++thread)
+            {
+                for (const CpuInfo &info : topology)
+                {
+                    if (info.cpu == order[thread])
+                    {
+                        cores.insert(info.core);
+                    }
+                }
+            }
+            EXPECT_EQ(cores.size(), num_threads);
+        }
+
+    } // namespace
+} // namespace gcpp